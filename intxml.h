@@ -1,9 +1,14 @@
 #pragma once
 
 #include <exception>
+#include <algorithm>
 #include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <string>
 #include <iterator>
+#include <vector>
 
 // This file contains a set of low-level routines for parsing the various 
 // constructs in an XML document.
@@ -19,12 +24,225 @@ namespace intxml
         };
     };
 
+    // Thrown when elements are nested deeper than the limit passed to the 
+    // element parsing routines.
+    class depth_limit_exception : public parsing_exception
+    {
+    public:
+        template <typename chptr_t>
+        depth_limit_exception(chptr_t& c) : parsing_exception(c)
+        {
+        };
+    };
+
+    // Default nesting limit for the element parsing routines.  Element 
+    // parsing is iterative, so this only guards against runaway input rather 
+    // than protecting the call stack.
+    const std::size_t default_max_depth = 4096;
+
     template <typename chptr_t>
     bool is_null(chptr_t& c)
     {
         return *c == 0;
     }
 
+    // Declarations of the routines below, which call each other in no
+    // particular order.  Templates instantiated for plain pointers can only
+    // find functions declared before their definitions, since argument-
+    // dependent lookup doesn't apply to them.
+    template <int ch, typename chptr_t> void parse(chptr_t& c);
+    template <typename chptr_t> int parse_character_reference(chptr_t& c);
+    template <typename chptr_t> int parse_decimal_character_reference(chptr_t& c);
+    template <typename chptr_t> int parse_hex_character_reference(chptr_t& c);
+    template <typename chptr_t> int parse_entity_reference(chptr_t& c);
+    template <typename chptr_t> void parse_start_tag_lt(chptr_t& c);
+    template <typename chptr_t> void parse_name(chptr_t& c);
+    template <typename chptr_t> std::size_t parse_name_hashed(chptr_t& c, std::uint32_t& hash);
+    template <typename chptr_t> void parse_start_tag_name(chptr_t& c);
+    template <typename chptr_t> bool parse_start_tag_name_end(chptr_t& c);
+    template <typename chptr_t> bool parse_start_tag_attribute_end(chptr_t& c);
+    template <typename chptr_t> void parse_attribute_name(chptr_t& c);
+    template <typename chptr_t> void parse_attribute_value(chptr_t& c);
+    template <typename chptr_t> bool parse_start_tag_end(chptr_t& c);
+    template <typename chptr_t> void parse_element_value(chptr_t& c);
+    template <typename chptr_t> void parse_end_tag(chptr_t& c);
+    template <typename chptr_t> void parse_xmldecl_content(chptr_t& c);
+    template <typename chptr_t> void parse_xmldecl_end(chptr_t& c);
+    template <typename chptr_t> void parse_xmldecl_content_end(chptr_t& c);
+    template <typename chptr_t> void parse_pi_content_end(chptr_t& c);
+    template <typename chptr_t> void parse_comment_content_end(chptr_t& c);
+    template <typename chptr_t> void parse_comment_dash_content_end(chptr_t& c);
+    template <typename chptr_t> void parse_doctypedecl_content_end(chptr_t& c);
+    template <typename chptr_t> void parse_prolog(chptr_t& c);
+    template <typename chptr_t> void parse_whitespace(chptr_t& c);
+    template <typename chptr_t> void parse_element_content(chptr_t& c, std::size_t max_depth = default_max_depth);
+    template <typename chptr_t> bool parse_element_text(chptr_t& c);
+    template <typename chptr_t> void parse_cdata_content_end(chptr_t& c);
+    template <typename chptr_t> void parse_element_name_end(chptr_t& c, std::size_t max_depth = default_max_depth);
+    template <typename chptr_t> void parse_element_attribute_end(chptr_t& c, std::size_t max_depth = default_max_depth);
+    template <typename chptr_t> void parse_attribute(chptr_t& c);
+    template <typename chptr_t> void parse_attributes(chptr_t& c);
+    template <typename chptr_t> void parse_doc(chptr_t& c, std::size_t max_depth = default_max_depth);
+
+    // Number of readable bytes required past the terminating NUL of a 
+    // document accessed through padded_ptr.
+    const std::size_t padding = 32;
+
+    // Pointer into a contiguous, NUL-terminated document whose buffer extends
+    // at least padding bytes past the terminator.  It can be used wherever a 
+    // character pointer is expected, and lets routines that recognize it 
+    // read several bytes at a time without first checking for the end of the
+    // document.
+    class padded_ptr : public std::iterator<std::forward_iterator_tag, char>
+    {
+        const char* p;
+
+    public:
+        padded_ptr() : p(nullptr) {}
+
+        explicit padded_ptr(const char* ptr) : p(ptr) {}
+
+        const char* get() const { return p; }
+
+        char operator*() const { return *p; }
+
+        padded_ptr& operator++()
+        {
+            ++p;
+            return *this;
+        }
+
+        padded_ptr operator++(int)
+        {
+            padded_ptr tmp(*this);
+            ++p;
+            return tmp;
+        }
+
+        padded_ptr& operator+=(std::size_t n)
+        {
+            p += n;
+            return *this;
+        }
+
+        bool operator==(const padded_ptr& other) const { return p == other.p; }
+
+        bool operator!=(const padded_ptr& other) const { return p != other.p; }
+    };
+
+    // A copy of a document with the terminator and padding required by 
+    // padded_ptr.
+    class padded_buffer
+    {
+        std::vector<char> data;
+        std::size_t length;
+
+    public:
+        padded_buffer() : data(1 + padding, 0), length(0) {}
+
+        padded_buffer(const char* doc, std::size_t size) :
+            data(size + 1 + padding, 0), length(size)
+        {
+            std::copy(doc, doc + size, data.begin());
+        }
+
+        padded_ptr begin() const { return padded_ptr(data.data()); }
+
+        const char* c_str() const { return data.data(); }
+
+        std::size_t size() const { return length; }
+    };
+
+    // Advances c past the characters chs if they are next in the input, and 
+    // returns whether they were.  On a mismatch c is left unchanged, so 
+    // chptr_t must be a forward iterator.
+    template <char... chs, typename chptr_t>
+    bool match_literal(chptr_t& c)
+    {
+        static const char literal[] = { chs... };
+
+        chptr_t p(c);
+        for (char ch : literal)
+        {
+            if (*p != ch) return false;
+            ++p;
+        }
+        c = p;
+        return true;
+    }
+
+    // Padded input is compared with a single fixed-size memcmp, which 
+    // compilers reduce to one or two wide loads and compares.
+    template <char... chs>
+    bool match_literal(padded_ptr& c)
+    {
+        static_assert(sizeof...(chs) <= padding, "literal longer than the input padding");
+        static const char literal[] = { chs... };
+
+        if (std::memcmp(c.get(), literal, sizeof(literal)) != 0) return false;
+        c += sizeof(literal);
+        return true;
+    }
+
+    // Same as a sequence of parse<ch> calls, i.e., throws if the characters 
+    // chs are not next in the input.  Used for keywords and other multi-
+    // character markup.
+    template <char... chs, typename chptr_t>
+    void parse_literal(chptr_t& c)
+    {
+        static const char literal[] = { chs... };
+
+        for (char ch : literal)
+        {
+            if (*c != ch) throw parsing_exception(c);
+            ++c;
+        }
+    }
+
+    template <char... chs>
+    void parse_literal(padded_ptr& c)
+    {
+        if (!match_literal<chs...>(c)) throw parsing_exception(c);
+    }
+
+    // Advances c past the next occurrence of count or more ch characters 
+    // followed by ">", e.g., the "]]>" ending a CDATA section.  Throws if the
+    // end of the document is reached first.  This never needs to back up, so 
+    // it works with input iterators.
+    template <char ch, std::size_t count, typename chptr_t>
+    void parse_until_terminator(chptr_t& c)
+    {
+        std::size_t run = 0;
+        while (true)
+        {
+            if (*c == ch) ++run;
+            else if (*c == '>' && run >= count) break;
+            else if (is_null(c)) throw parsing_exception(c);
+            else run = 0;
+            ++c;
+        }
+        ++c;
+    }
+
+    // On padded input, the library's strchr finds each candidate run many 
+    // bytes at a time.
+    template <char ch, std::size_t count>
+    void parse_until_terminator(padded_ptr& c)
+    {
+        const char* p = c.get();
+        while (true)
+        {
+            p = std::strchr(p, ch);
+            if (!p) throw parsing_exception(c);
+
+            std::size_t run = 1;
+            while (p[run] == ch) ++run;
+            p += run;
+            if (run >= count && *p == '>') break;
+        }
+        c = padded_ptr(p + 1);
+    }
+
     template <typename chptr_t>
     class name_ptr
     {
@@ -171,8 +389,8 @@ namespace intxml
             if (*c == '!')
             {
                 ++c;
-                parse<'-'>(c);
-                parse_comment_dash_content_end(c);
+                parse_literal<'-', '-'>(c);
+                parse_comment_content_end(c);
             }
             else end = true;
         }
@@ -195,7 +413,12 @@ namespace intxml
 
         text_ptr& operator++()
         {
-            if (entity) entity = 0;
+            if (entity)
+            {
+                // c already follows the reference.
+                entity = 0;
+                lookahead();
+            }
             else if (!end)
             {
                 ++c;
@@ -230,25 +453,28 @@ namespace intxml
         else return parse_decimal_character_reference(c);
     }
 
+    // The character reference routines throw as soon as the number exceeds
+    // the largest code point, so that it can't wrap around to a small one.
     template <typename chptr_t>
     int parse_decimal_character_reference(chptr_t& c)
     {
-        int entity = 0;
+        std::uint32_t entity = 0;
         int digit;
         while ((digit = *c) != ';')
         {
             if (digit < 0x30 || digit > 0x39) throw parsing_exception(c);
             entity = entity * 10 + (digit & 0x0f);
+            if (entity > 0x10ffff) throw parsing_exception(c);
             ++c;
         }
         ++c;
-        return entity;
+        return static_cast<int>(entity);
     }
 
     template <typename chptr_t>
     int parse_hex_character_reference(chptr_t& c)
     {
-        int entity = 0;
+        std::uint32_t entity = 0;
         int digit;
         while ((digit = *c) != ';')
         {
@@ -257,65 +483,107 @@ namespace intxml
                 entity = entity * 16 + (digit & 0x0f);
             }
             else if ((digit >= 0x61 && digit <= 0x66) ||
-                     (digit < 0x41 || digit > 0x46))
+                     (digit >= 0x41 && digit <= 0x46))
             {
                 entity = entity * 16 + ((digit & 0x0f) + 9);
             }
             else throw parsing_exception(c);
+            if (entity > 0x10ffff) throw parsing_exception(c);
             ++c;
         }
         ++c;
-        return entity;
+        return static_cast<int>(entity);
     }
 
+    // The entities that don't require declaration, with their terminating 
+    // ';'.
+    struct predefined_entity
+    {
+        const char* name;
+        std::size_t length;
+        char value;
+    };
+
+    const std::size_t predefined_entity_count = 5;
+
+    inline const predefined_entity* predefined_entities()
+    {
+        static const predefined_entity table[predefined_entity_count] =
+        {
+            { "lt;", 3, '<' },
+            { "gt;", 3, '>' },
+            { "amp;", 4, '&' },
+            { "apos;", 5, '\'' },
+            { "quot;", 5, '"' }
+        };
+        return table;
+    }
+
+    // Parses the name and ';' of an entity reference (following the "&") 
+    // and returns the character it stands for.  The name is read into a 
+    // small buffer and looked up in the table of predefined entities.
     template <typename chptr_t>
     int parse_entity_reference(chptr_t& c)
     {
-        int entity = '?';
-
-        // This only supports the standard entities that don't require 
-        // declaration- lt, gt, amp, apos, quot.
-        if (*c == 'l')
+        char name[5];
+        std::size_t length = 0;
+        do
         {
+            if (length == sizeof(name) || is_null(c)) throw parsing_exception(c);
+            name[length++] = *c;
             ++c;
-            parse<'t'>(c);
-            entity = '<';
-        }
-        else if (*c == 'g')
+        } while (name[length - 1] != ';');
+
+        const predefined_entity* entities = predefined_entities();
+        for (std::size_t i = 0; i < predefined_entity_count; ++i)
         {
-            ++c;
-            parse<'t'>(c);
-            entity = '>';
+            if (entities[i].length == length &&
+                std::memcmp(entities[i].name, name, length) == 0)
+            {
+                return entities[i].value;
+            }
         }
-        else if (*c == 'a')
+        throw parsing_exception(c);
+    }
+
+    // On padded input the next eight bytes are loaded as one word, and each 
+    // entity is checked with a single masked compare.
+    inline int parse_entity_reference(padded_ptr& c)
+    {
+        struct words
         {
-            if (*c == 'm')
+            std::uint64_t mask[predefined_entity_count];
+            std::uint64_t bits[predefined_entity_count];
+
+            words()
             {
-                ++c;
-                parse<'p'>(c);
-                entity = '&';
+                const predefined_entity* entities = predefined_entities();
+                for (std::size_t i = 0; i < predefined_entity_count; ++i)
+                {
+                    unsigned char m[8] = { 0 };
+                    char b[8] = { 0 };
+                    std::memset(m, 0xff, entities[i].length);
+                    std::memcpy(b, entities[i].name, entities[i].length);
+                    std::memcpy(&mask[i], m, 8);
+                    std::memcpy(&bits[i], b, 8);
+                }
             }
-            else if (*c == 'p')
+        };
+        static const words table;
+
+        std::uint64_t word;
+        std::memcpy(&word, c.get(), 8);
+
+        const predefined_entity* entities = predefined_entities();
+        for (std::size_t i = 0; i < predefined_entity_count; ++i)
+        {
+            if ((word & table.mask[i]) == table.bits[i])
             {
-                ++c;
-                parse<'o'>(c);
-                parse<'s'>(c);
-                entity = '\'';
+                c += entities[i].length;
+                return entities[i].value;
             }
-            else throw parsing_exception(c);
-        }
-        else if (*c == 'q')
-        {
-            ++c;
-            parse<'u'>(c);
-            parse<'o'>(c);
-            parse<'t'>(c);
-            entity = '"';
         }
-        else throw parsing_exception(c);
-
-        parse<';'>(c);
-        return entity;
+        throw parsing_exception(c);
     }
 
     // Parses the "<" of a start tag.
@@ -342,6 +610,32 @@ namespace intxml
         }
     }
 
+    // Same as parse_name, but also returns the length of the name and 
+    // computes an FNV-1a hash of its characters.  Used where names need to 
+    // be compared later without re-scanning them.
+    template <typename chptr_t>
+    std::size_t parse_name_hashed(chptr_t& c, std::uint32_t& hash)
+    {
+        if (!std::isalpha(*c) && *c != '_') throw parsing_exception(c);
+
+        std::size_t length = 0;
+        hash = 2166136261u;
+        do
+        {
+            hash = (hash ^ static_cast<unsigned char>(*c)) * 16777619u;
+            ++length;
+            ++c;
+        } while (
+            std::isalpha(*c) || 
+            std::isdigit(*c) || 
+            *c == '.' || 
+            *c == '-' || 
+            *c == '_' || 
+            *c == ':');
+
+        return length;
+    }
+
     // Parses tag name by calling the supplied handler with an object that provides transparent access to the characters in the name.
     template <typename chptr_t>
     void parse_start_tag_name(chptr_t& c)
@@ -404,8 +698,7 @@ namespace intxml
         }
         else
         {
-            parse<'/'>(c);
-            parse<'>'>(c);
+            parse_literal<'/', '>'>(c);
             return false;
         }
     }
@@ -439,8 +732,7 @@ namespace intxml
     template <typename chptr_t>
     void parse_xmldecl_end(chptr_t& c)
     {
-        parse<'?'>(c);
-        parse<'>'>(c);
+        parse_literal<'?', '>'>(c);
     }
 
     template <typename chptr_t>
@@ -450,44 +742,28 @@ namespace intxml
         parse_xmldecl_end(c);
     }
 
+    // Parses the rest of a processing instruction following the "<?", 
+    // including the closing "?>".
     template <typename chptr_t>
     void parse_pi_content_end(chptr_t& c)
     {
-        while (true)
-        {
-            while (*c != '?')
-            {
-                if (is_null(c)) throw parsing_exception(c);
-                ++c;
-            }
+        parse_until_terminator<'?', 1>(c);
+    }
 
-            ++c;
-            if (*c == '>') break;
-        }
+    // Parses the rest of a comment following the "<!--", including the 
+    // closing "-->".
+    template <typename chptr_t>
+    void parse_comment_content_end(chptr_t& c)
+    {
+        parse_until_terminator<'-', 2>(c);
     }
 
+    // Same as above, starting from the second dash of the "<!--".
     template <typename chptr_t>
     void parse_comment_dash_content_end(chptr_t& c)
     {
         parse<'-'>(c);
-
-        while (true)
-        {
-            while (*c != '-')
-            {
-                if (is_null(c)) throw parsing_exception(c);
-                ++c;
-            }
-
-            ++c;
-            if (*c == '-')
-            {
-                ++c;
-                break;
-            }
-        }
-
-        parse<'>'>(c);
+        parse_comment_content_end(c);
     }
 
     template <typename chptr_t>
@@ -501,31 +777,40 @@ namespace intxml
         ++c;
     }
 
+    // Parses the XML declaration, processing instructions, comments and 
+    // document type declaration preceding the root element, and the "<" of 
+    // its start tag.
     template <typename chptr_t>
     void parse_prolog(chptr_t& c)
     {
         parse_whitespace(c);
         parse<'<'>(c);
 
-        if (*c == '?')
+        while (true)
         {
-            ++c;
-            parse_xmldecl_content_end(c);
-
-            while (true)
+            if (*c == '?')
             {
-                parse_whitespace(c);
-                parse<'<'>(c);
-
-                if (*c == '?') parse_pi_content_end(c);
-                else if (*c == '!')
+                ++c;
+                parse_pi_content_end(c);
+            }
+            else if (*c == '!')
+            {
+                ++c;
+                if (*c == '-')
                 {
-                    ++c;
-                    if (*c == '-') parse_comment_dash_content_end(c);
-                    else parse_doctypedecl_content_end(c);
+                    parse_literal<'-', '-'>(c);
+                    parse_comment_content_end(c);
+                }
+                else
+                {
+                    parse_literal<'D', 'O', 'C', 'T', 'Y', 'P', 'E'>(c);
+                    parse_doctypedecl_content_end(c);
                 }
-                else break;
             }
+            else break;
+
+            parse_whitespace(c);
+            parse<'<'>(c);
         }
     }
 
@@ -536,23 +821,46 @@ namespace intxml
         while (!is_null(c) && std::isspace(*c)) ++c;
     }
 
+    // Parses the remaining content of an element, including its end tag.  
+    // Nested elements are handled iteratively: since none of the routines 
+    // here need anything from the enclosing tags, the stack of open elements 
+    // reduces to a depth counter, which is kept in a local along with a copy 
+    // of the cursor for the duration of the loop.  Throws 
+    // depth_limit_exception if more than max_depth elements with content 
+    // would be open at once, counting the current one.  Empty elements are 
+    // never open, so they are accepted one level further down: with 
+    // max_depth 2, <a><b><c/></b></a> passes but <a><b><c></c></b></a> 
+    // doesn't.  The index, the subtree hashes and the strict checker apply
+    // the same limit.
     template <typename chptr_t>
-    void parse_element_content(chptr_t& c)
+    void parse_element_content(chptr_t& c, std::size_t max_depth)
     {
+        chptr_t p(c);
+
+        // Open elements, including the current one.
+        std::size_t depth = 1;
+
         while (true)
         {
-            if (parse_element_text(c))
+            if (parse_element_text(p))
             {
-                parse_element_name_end(c);
+                parse_name(p);
+                parse_attributes(p);
+                if (parse_start_tag_end(p) && ++depth > max_depth)
+                {
+                    throw depth_limit_exception(p);
+                }
             }
             else
             {
-                parse<'/'>(c);
-                parse_name(c);
-                parse<'>'>(c);
-                break;
+                parse<'/'>(p);
+                parse_name(p);
+                parse<'>'>(p);
+                if (--depth == 0) break;
             }
         }
+
+        c = p;
     }
 
     // Returns true if more content remains in the element.  Upon returning 
@@ -578,18 +886,12 @@ namespace intxml
                 ++c;
                 if (*c == '-')
                 {
-                    ++c;
-                parse_comment_dash_content_end(c);
-            }
-                else if (*c == '[')
+                    parse_literal<'-', '-'>(c);
+                    parse_comment_content_end(c);
+                }
+                else
                 {
-                    ++c;
-                    parse<'C'>(c);
-                    parse<'D'>(c);
-                    parse<'A'>(c);
-                    parse<'T'>(c);
-                    parse<'A'>(c);
-                    parse<'['>(c);
+                    parse_literal<'[', 'C', 'D', 'A', 'T', 'A', '['>(c);
                     parse_cdata_content_end(c);
                 }
             }
@@ -597,41 +899,27 @@ namespace intxml
         }
     }
 
+    // Parses the rest of a CDATA section following the "<![CDATA[", 
+    // including the closing "]]>".
     template <typename chptr_t>
     void parse_cdata_content_end(chptr_t& c)
     {
-        while (!is_null(c))
-        {
-            if (*c == ']')
-            {
-                ++c;
-                if (*c == ']')
-                {
-                    ++c;
-                    if (*c == '>')
-                    {
-                        ++c;
-                        return;
-                    }
-                }
-            }
-            else ++c;
-        }
+        parse_until_terminator<']', 2>(c);
     }
 
     template <typename chptr_t>
-    void parse_element_name_end(chptr_t& c)
+    void parse_element_name_end(chptr_t& c, std::size_t max_depth)
     {
         parse_name(c);
         parse_whitespace(c);
-        return parse_element_attribute_end(c);
+        return parse_element_attribute_end(c, max_depth);
     }
 
     template <typename chptr_t>
-    void parse_element_attribute_end(chptr_t& c)
+    void parse_element_attribute_end(chptr_t& c, std::size_t max_depth)
     {
         parse_attributes(c);
-        if (parse_start_tag_end(c)) parse_element_content(c);
+        if (parse_start_tag_end(c)) parse_element_content(c, max_depth);
     }
 
     template <typename chptr_t>
@@ -657,9 +945,9 @@ namespace intxml
     }
 
     template <typename chptr_t>
-    void parse_doc(chptr_t& c)
+    void parse_doc(chptr_t& c, std::size_t max_depth)
     {
         parse_prolog(c);
-        parse_element_name_end(c);
+        parse_element_name_end(c, max_depth);
     }
 }
\ No newline at end of file
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "intxml.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// This file implements an index of the attributes of a single start tag.
+// The attribute list is scanned once, and each name is hashed as it is
+// parsed into an open-addressing table, so looking up any number of
+// attributes by name afterwards costs O(1) each instead of a walk of the
+// list.  Up to inline_capacity attributes are stored within the object
+// itself, so indexing a typical element doesn't allocate; wider elements
+// spill over to the heap.
+
+namespace intxml
+{
+    template <typename chptr_t>
+    struct indexed_attribute
+    {
+        chptr_t name;
+        std::uint32_t name_length;
+        std::uint32_t name_hash;
+
+        // The raw characters of the value, excluding the quotes.
+        chptr_t value_begin;
+        chptr_t value_end;
+    };
+
+    template <typename chptr_t, std::size_t inline_capacity = 16>
+    class attribute_index
+    {
+        typedef indexed_attribute<chptr_t> entry;
+
+        entry inline_entries[inline_capacity];
+
+        // Slots hold entry numbers plus one, so that zero marks an empty
+        // slot.
+        std::uint32_t inline_slots[inline_capacity * 2];
+        std::vector<entry> heap_entries;
+        std::vector<std::uint32_t> heap_slots;
+        std::size_t count;
+        std::size_t mask;
+        chptr_t end;
+
+        static std::uint32_t hash(const char* name, std::size_t length)
+        {
+            std::uint32_t h = 2166136261u;
+            for (std::size_t i = 0; i < length; ++i)
+            {
+                h = (h ^ static_cast<unsigned char>(name[i])) * 16777619u;
+            }
+            return h;
+        }
+
+        static bool equal(const entry& e, const char* name, std::size_t length)
+        {
+            if (e.name_length != length) return false;
+
+            chptr_t p(e.name);
+            for (std::size_t i = 0; i < length; ++i, ++p)
+            {
+                if (*p != name[i]) return false;
+            }
+            return true;
+        }
+
+        // Whichever storage is in use is found from the vectors rather than
+        // kept in pointers, so that copies of the index remain valid.
+        const std::uint32_t* slots() const
+        {
+            return heap_slots.empty() ? inline_slots : heap_slots.data();
+        }
+
+        void add(const entry& e)
+        {
+            if (count < inline_capacity) inline_entries[count] = e;
+            else
+            {
+                // Move everything to the heap once the inline storage is
+                // full.
+                if (count == inline_capacity)
+                {
+                    heap_entries.reserve(inline_capacity * 4);
+                    heap_entries.assign(inline_entries, inline_entries + count);
+                }
+                heap_entries.push_back(e);
+            }
+            ++count;
+        }
+
+        void rehash()
+        {
+            std::size_t size = inline_capacity * 2;
+            while (size < count * 2) size *= 2;
+
+            std::uint32_t* table = inline_slots;
+            if (size > inline_capacity * 2)
+            {
+                heap_slots.assign(size, 0);
+                table = heap_slots.data();
+            }
+            std::fill(table, table + size, 0);
+            mask = size - 1;
+
+            const entry* all = data();
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                std::size_t s = all[i].name_hash & mask;
+                while (table[s]) s = (s + 1) & mask;
+                table[s] = static_cast<std::uint32_t>(i + 1);
+            }
+        }
+
+    public:
+        // Indexes the attribute list starting at c, which points to the
+        // first attribute name or to the "/>" or ">" ending the start tag
+        // (e.g., the position of a parser::attribute).
+        attribute_index(chptr_t c) : count(0)
+        {
+            parse_whitespace(c);
+            while (*c != '/' && *c != '>')
+            {
+                entry e;
+                e.name = c;
+                e.name_length = static_cast<std::uint32_t>(parse_name_hashed(c, e.name_hash));
+                parse_whitespace(c);
+                parse<'='>(c);
+                parse_whitespace(c);
+
+                char quote = *c;
+                if (quote != '\'' && quote != '"') throw parsing_exception(c);
+                e.value_begin = ++c;
+                while (*c != quote)
+                {
+                    if (is_null(c)) throw parsing_exception(c);
+                    ++c;
+                }
+                e.value_end = c;
+                ++c;
+
+                add(e);
+                parse_whitespace(c);
+            }
+            end = c;
+            rehash();
+        }
+
+        std::size_t size() const { return count; }
+
+        const entry* data() const
+        {
+            return count > inline_capacity ? heap_entries.data() : inline_entries;
+        }
+
+        const entry& operator[](std::size_t i) const { return data()[i]; }
+
+        // The "/>" or ">" ending the start tag.
+        const chptr_t& attributes_end() const { return end; }
+
+        // Returns the attribute with the given name, or null if the element
+        // doesn't have one.
+        const entry* get(const char* name, std::size_t length) const
+        {
+            const entry* all = data();
+            const std::uint32_t* table = slots();
+            for (std::size_t s = hash(name, length) & mask; table[s]; s = (s + 1) & mask)
+            {
+                const entry& e = all[table[s] - 1];
+                if (equal(e, name, length)) return &e;
+            }
+            return nullptr;
+        }
+
+        const entry* get(const char* name) const
+        {
+            return get(name, std::strlen(name));
+        }
+    };
+}
\ No newline at end of file
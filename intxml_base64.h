@@ -0,0 +1,209 @@
+#pragma once
+
+#include "intxml_parser.h"
+#include "intxml_simd.h"
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+
+// This file implements decoding base64 text content (e.g., xs:base64Binary
+// payloads) straight into a caller's sink, without materializing either the
+// text or the decoded bytes.  It consumes the chunks produced by
+// parse_text_chunks (see intxml_text.h) and hands the decoded bytes on in
+// chunks of up to base64_decoder::buffer_size, so memory use is constant
+// however large the payload is.
+//
+// Whitespace anywhere in the text is ignored, and padding may be left out
+// of the last quantum.  With SSSE3, 16 characters at a time are validated
+// and translated with byte shuffles (W. Mula's and D. Lemire's method);
+// blocks containing anything else, e.g., line breaks, fall back to the
+// scalar loop.
+
+namespace intxml
+{
+    class base64_exception : public std::exception
+    {
+    };
+
+    class base64_decoder
+    {
+    public:
+        static const std::size_t buffer_size = 1 << 14;
+
+    private:
+        enum
+        {
+            value_padding = 0x40,
+            value_whitespace = 0x41,
+            value_invalid = 0xff
+        };
+
+        // The SIMD path stores 16 bytes for every 12 it produces.
+        char out[buffer_size + 16];
+        std::size_t count;
+
+        // Sextets of the current quantum, and the number of "=" seen.
+        std::uint32_t bits;
+        unsigned sextets;
+        unsigned padding;
+
+        static const unsigned char* values()
+        {
+            struct table
+            {
+                unsigned char v[256];
+
+                table()
+                {
+                    for (int i = 0; i < 256; ++i) v[i] = value_invalid;
+                    const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+                    for (int i = 0; i < 64; ++i) v[static_cast<unsigned char>(alphabet[i])] = static_cast<unsigned char>(i);
+                    v['='] = value_padding;
+                    v[' '] = v['\t'] = v['\n'] = v['\r'] = value_whitespace;
+                }
+            };
+            static const table t;
+            return t.v;
+        }
+
+        template <typename sink>
+        void flush(sink& s)
+        {
+            if (count != 0)
+            {
+                s(static_cast<const char*>(out), static_cast<const char*>(out + count));
+                count = 0;
+            }
+        }
+
+        // Writes the bytes of a quantum of n sextets (2 to 4).
+        void put_quantum(unsigned n)
+        {
+            std::uint32_t b = bits << (6 * (4 - n));
+            out[count++] = static_cast<char>(b >> 16);
+            if (n > 2) out[count++] = static_cast<char>(b >> 8);
+            if (n > 3) out[count++] = static_cast<char>(b);
+            bits = 0;
+            sextets = 0;
+        }
+
+#ifdef INTXML_SSSE3
+        // Decodes 16 characters at p to 12 bytes at dest (storing 16), or
+        // returns false if any of them isn't in the alphabet.
+        static bool decode_block(const char* p, char* dest)
+        {
+            const __m128i lut_lo = _mm_setr_epi8(
+                0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+            const __m128i lut_hi = _mm_setr_epi8(
+                0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+            const __m128i lut_roll = _mm_setr_epi8(
+                0, 16, 19, 4, -65, -65, -71, -71,
+                0, 0, 0, 0, 0, 0, 0, 0);
+            const __m128i mask_2f = _mm_set1_epi8(0x2f);
+
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+
+            // The tables map each nibble to the classes of characters that
+            // are outside the alphabet; a character is valid if its two
+            // nibbles have no class in common.
+            __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(x, 4), mask_2f);
+            __m128i lo_nibbles = _mm_and_si128(x, mask_2f);
+            __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+            __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+            __m128i valid = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+            if (_mm_movemask_epi8(valid) != 0xffff) return false;
+
+            // Translate to sextets, "/" being the one character whose offset
+            // differs from the rest of its high nibble.
+            __m128i eq_2f = _mm_cmpeq_epi8(x, mask_2f);
+            __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+            x = _mm_add_epi8(x, roll);
+
+            // Pack four sextets into three bytes per 32-bit lane.
+            x = _mm_maddubs_epi16(x, _mm_set1_epi32(0x01400140));
+            x = _mm_madd_epi16(x, _mm_set1_epi32(0x00011000));
+            x = _mm_shuffle_epi8(x, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), x);
+            return true;
+        }
+#endif
+
+    public:
+        base64_decoder() : count(0), bits(0), sextets(0), padding(0) {}
+
+        // Decodes the characters in [p, end), passing full buffers to
+        // s(begin, end).
+        template <typename sink>
+        void decode(const char* p, const char* end, sink& s)
+        {
+            const unsigned char* v = values();
+            while (p != end)
+            {
+#ifdef INTXML_SSSE3
+                if (sextets == 0 && padding == 0)
+                {
+                    while (end - p >= 16)
+                    {
+                        if (count >= buffer_size) flush(s);
+                        if (!decode_block(p, out + count)) break;
+                        p += 16;
+                        count += 12;
+                    }
+                    if (p == end) break;
+                }
+#endif
+                unsigned char x = v[static_cast<unsigned char>(*p++)];
+                if (x < 64)
+                {
+                    if (padding != 0) throw base64_exception();
+                    bits = (bits << 6) | x;
+                    if (++sextets == 4)
+                    {
+                        put_quantum(4);
+                        if (count >= buffer_size) flush(s);
+                    }
+                }
+                else if (x == value_padding)
+                {
+                    // "=" completes a quantum of 2 or 3 sextets; nothing
+                    // but whitespace may follow it.
+                    if (sextets + padding < 2 || sextets + padding == 4) throw base64_exception();
+                    if (++padding + sextets == 4)
+                    {
+                        put_quantum(sextets);
+                        padding = 4;
+                    }
+                }
+                else if (x != value_whitespace) throw base64_exception();
+            }
+        }
+
+        // Decodes the last, possibly unpadded, quantum and passes the
+        // remaining bytes to s.  Throws base64_exception if the text was
+        // truncated.
+        template <typename sink>
+        void finish(sink& s)
+        {
+            if (padding != 0 && padding != 4) throw base64_exception();
+            if (sextets == 1) throw base64_exception();
+            if (sextets != 0) put_quantum(sextets);
+            flush(s);
+            padding = 0;
+        }
+    };
+
+    // Decodes the base64 text at content into s(begin, end), which is
+    // called with const char* bounds for each chunk of decoded bytes, and
+    // returns the element following the text.
+    template <typename chptr_t, typename sink>
+    parser::element<chptr_t> decode_base64(parser::content<chptr_t> content, sink s)
+    {
+        base64_decoder decoder;
+        parser::element<chptr_t> next = content.text(
+            [&](const char* begin, const char* end) { decoder.decode(begin, end, s); });
+        decoder.finish(s);
+        return next;
+    }
+}
\ No newline at end of file
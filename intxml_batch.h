@@ -0,0 +1,309 @@
+#pragma once
+
+#include "intxml_parser.h"
+#include "intxml_strict.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#endif
+
+// This file implements parsing of many small documents (e.g., messages off
+// a bus) in batches.  At 1-4K per document, the fixed cost of each parse
+// matters as much as the parse itself, so everything that can be is set up
+// once per thread rather than once per document:
+//
+//  - Each message is copied into a thread-local arena that is only ever
+//    grown, and which provides the terminating NUL and the padding that the
+//    padded_ptr fast paths need.  Messages therefore don't have to be
+//    NUL-terminated, and nothing is allocated once the arena is as large as
+//    the largest message.
+//  - Strict checking reuses a thread-local well_formedness_checker, so its
+//    tag stack and attribute table are allocated once.
+//  - The first cache lines of the messages a few places ahead are
+//    prefetched while the current one is parsed, hiding the latency of
+//    reaching each new message.
+//  - A batch_parser keeps its worker threads between batches.  Workers take
+//    messages from the batch in small groups, so uneven message sizes even
+//    out.
+//
+// The outcome of each message is reported in a status vector, so a
+// malformed message doesn't stop the rest of the batch.
+
+namespace intxml
+{
+    // A message in memory; it needn't be NUL-terminated.
+    struct message_span
+    {
+        const char* data;
+        std::size_t size;
+    };
+
+    enum message_status
+    {
+        message_ok,
+        message_malformed,
+        message_too_deep,
+
+        // The handler threw something other than a parsing exception, or
+        // the message couldn't be copied into the scratch buffer.
+        message_failed
+    };
+
+    struct batch_options
+    {
+        // Threads used by batch_parser, including the calling thread; 0
+        // uses the hardware concurrency.
+        std::size_t threads;
+
+        // Passed to the element parsing routines.
+        std::size_t max_depth;
+
+        // Validates with well_formedness_checker rather than parse_doc.
+        bool strict;
+
+        // How many messages ahead to prefetch; 0 disables prefetching.
+        std::size_t prefetch_distance;
+
+        // Messages taken by a thread at a time.
+        std::size_t grain;
+
+        batch_options() :
+            threads(1), max_depth(default_max_depth), strict(false), prefetch_distance(4), grain(64)
+        {
+        }
+    };
+
+    inline void prefetch(const void* p)
+    {
+#if defined(_MSC_VER)
+        _mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#elif defined(__GNUC__)
+        __builtin_prefetch(p);
+#endif
+    }
+
+    // Per-thread state reused from message to message.
+    class batch_scratch
+    {
+        std::vector<char> arena;
+        std::unique_ptr<well_formedness_checker<padded_ptr>> strict;
+        std::size_t strict_depth;
+
+    public:
+        batch_scratch() : strict_depth(0) {}
+
+        static batch_scratch& local()
+        {
+            thread_local batch_scratch scratch;
+            return scratch;
+        }
+
+        // Copies the message into the arena and returns a cursor at its
+        // start.  The copy is overwritten by the next call.
+        padded_ptr copy(const message_span& m)
+        {
+            std::size_t needed = m.size + 1 + padding;
+            if (arena.size() < needed) arena.resize(std::max(needed, arena.size() * 2));
+
+            std::memcpy(arena.data(), m.data, m.size);
+            std::memset(arena.data() + m.size, 0, 1 + padding);
+            return padded_ptr(arena.data());
+        }
+
+        well_formedness_checker<padded_ptr>& checker(std::size_t max_depth)
+        {
+            if (!strict || strict_depth != max_depth)
+            {
+                strict.reset(new well_formedness_checker<padded_ptr>(256, 32, max_depth));
+                strict_depth = max_depth;
+            }
+            return *strict;
+        }
+    };
+
+    class batch_parser
+    {
+        batch_options options;
+        std::vector<std::thread> workers;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable finished;
+        std::function<void()> job;
+        std::size_t generation;
+        std::size_t active;
+        bool stop;
+
+        void work()
+        {
+            std::size_t seen = 0;
+            while (true)
+            {
+                std::function<void()> current;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wake.wait(guard, [&] { return stop || generation != seen; });
+                    if (stop) return;
+                    seen = generation;
+                    current = job;
+                }
+
+                current();
+
+                std::lock_guard<std::mutex> guard(lock);
+                if (--active == 0) finished.notify_all();
+            }
+        }
+
+        // Runs f on every thread, including the calling one, and waits for
+        // all of them to return.
+        void run(const std::function<void()>& f)
+        {
+            if (workers.empty())
+            {
+                f();
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                job = f;
+                active = workers.size();
+                ++generation;
+            }
+            wake.notify_all();
+
+            f();
+
+            std::unique_lock<std::mutex> guard(lock);
+            finished.wait(guard, [&] { return active == 0; });
+            job = nullptr;
+        }
+
+        // Parses messages [first, last) with h(i, c, scratch), recording the
+        // outcome of each.
+        template <typename handler>
+        void process(
+            const std::vector<message_span>& messages,
+            std::vector<message_status>& status,
+            std::size_t first,
+            std::size_t last,
+            batch_scratch& scratch,
+            handler& h)
+        {
+            std::size_t distance = options.prefetch_distance;
+            for (std::size_t i = first; i < last; ++i)
+            {
+                if (distance && i + distance < messages.size())
+                {
+                    const char* ahead = messages[i + distance].data;
+                    prefetch(ahead);
+                    prefetch(ahead + 64);
+                }
+
+                try
+                {
+                    padded_ptr c = scratch.copy(messages[i]);
+                    h(i, c, scratch);
+                    status[i] = message_ok;
+                }
+                catch (const depth_limit_exception&)
+                {
+                    status[i] = message_too_deep;
+                }
+                catch (const parsing_exception&)
+                {
+                    status[i] = message_malformed;
+                }
+                catch (const parser::parser_exception&)
+                {
+                    status[i] = message_malformed;
+                }
+                catch (...)
+                {
+                    status[i] = message_failed;
+                }
+            }
+        }
+
+        template <typename handler>
+        void dispatch(
+            const std::vector<message_span>& messages,
+            std::vector<message_status>& status,
+            handler h)
+        {
+            status.resize(messages.size());
+
+            std::size_t grain = std::max<std::size_t>(options.grain, 1);
+            std::atomic<std::size_t> next(0);
+            run([&]()
+            {
+                batch_scratch& scratch = batch_scratch::local();
+                while (true)
+                {
+                    std::size_t first = next.fetch_add(grain);
+                    if (first >= messages.size()) break;
+                    process(messages, status, first, std::min(first + grain, messages.size()), scratch, h);
+                }
+            });
+        }
+
+    public:
+        explicit batch_parser(const batch_options& o = batch_options()) :
+            options(o), generation(0), active(0), stop(false)
+        {
+            std::size_t threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+            for (std::size_t i = 1; i < threads; ++i) workers.emplace_back([this] { work(); });
+        }
+
+        batch_parser(const batch_parser&) = delete;
+        batch_parser& operator=(const batch_parser&) = delete;
+
+        ~batch_parser()
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stop = true;
+            }
+            wake.notify_all();
+            for (std::thread& t : workers) t.join();
+        }
+
+        // Checks that each message is a document, setting status[i] to the
+        // outcome for messages[i].
+        void parse(const std::vector<message_span>& messages, std::vector<message_status>& status)
+        {
+            std::size_t max_depth = options.max_depth;
+            bool strict = options.strict;
+            dispatch(messages, status, [max_depth, strict](std::size_t, padded_ptr& c, batch_scratch& scratch)
+            {
+                if (strict) scratch.checker(max_depth).parse_doc(c);
+                else parse_doc(c, max_depth);
+            });
+        }
+
+        // Calls h(i, padded_ptr c) for each message, where c points to a
+        // padded copy of messages[i] that is valid until h returns.  h may be
+        // called from several threads at once, and reports a malformed
+        // message by throwing (e.g., from the parsing routines).
+        template <typename handler>
+        void parse(
+            const std::vector<message_span>& messages,
+            std::vector<message_status>& status,
+            handler h)
+        {
+            dispatch(messages, status, [&h](std::size_t i, padded_ptr& c, batch_scratch&)
+            {
+                h(i, c);
+            });
+        }
+    };
+}
\ No newline at end of file
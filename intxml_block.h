@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+
+// This file adapts block-oriented document sources to the character
+// pointers expected by intxml.h.  A block source hands out the document as a
+// sequence of contiguous ranges through
+//
+//     bool next_block(const char*& begin, const char*& end);
+//
+// which returns false once the input is exhausted.  The range returned by a
+// call remains valid until the next call, after which the source may reuse
+// its memory.
+
+namespace intxml
+{
+    // Input iterator over the characters of a block source.  Like
+    // istream_adapter, it reads as 0 at the end of the input.  Copies share
+    // the source, so only the most recently advanced copy may be used.
+    template <typename source_t>
+    class block_iterator : public std::iterator<std::input_iterator_tag, char>
+    {
+        source_t* source;
+        const char* p;
+        const char* end;
+
+        void fill()
+        {
+            while (p == end)
+            {
+                if (!source || !source->next_block(p, end))
+                {
+                    source = nullptr;
+                    p = end = nullptr;
+                    break;
+                }
+            }
+        }
+
+    public:
+        block_iterator(source_t& s) : source(&s), p(nullptr), end(nullptr)
+        {
+            fill();
+        }
+
+        char operator*()
+        {
+            return p ? *p : 0;
+        }
+
+        block_iterator& operator++()
+        {
+            if (p && ++p == end) fill();
+            return *this;
+        }
+
+        // The remainder of the current block, for callers that can consume
+        // characters in bulk.  Call skip() with the number used.
+        const char* block_begin() const { return p; }
+
+        const char* block_end() const { return end; }
+
+        void skip(std::size_t n)
+        {
+            p += n;
+            if (p == end) fill();
+        }
+    };
+}
\ No newline at end of file
@@ -0,0 +1,439 @@
+#pragma once
+
+#include "intxml.h"
+#include "intxml_simd.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// This file implements a canonicalizer that rewrites a document in a
+// normal form, so that documents that differ only in syntax come out
+// byte-identical.  It follows Canonical XML 1.0 (without comments) for the
+// constructs intxml.h parses:
+//
+//  - the XML declaration, DOCTYPE, comments and processing instructions in
+//    the prolog are dropped, and so are comments within the root element
+//  - empty elements are written as a start and end tag, and whitespace
+//    within tags is removed
+//  - attributes are written in double quotes, with namespace declarations
+//    first and the rest ordered by name
+//  - entity and character references are replaced by the characters they
+//    stand for, and CDATA sections by their (escaped) content, and only the
+//    characters that must be are escaped, always in the same form
+//  - line ends are normalized to "\n", and whitespace in attribute values
+//    to spaces
+//
+// Attributes are ordered by their qualified name rather than by namespace
+// URI and local name, as namespaces aren't resolved; for documents that use
+// the same prefixes for the same namespaces this makes no difference.
+//
+// The minify option additionally drops text consisting only of whitespace
+// and writes empty elements as "<a/>", which gives the smallest equivalent
+// document when whitespace between elements isn't significant.
+//
+// Text and attribute values are copied in runs between the characters that
+// need attention; with SSE2, runs are found 16 bytes at a time (see
+// intxml_simd.h).
+
+namespace intxml
+{
+    struct canonical_options
+    {
+        bool minify;
+        std::size_t max_depth;
+
+        canonical_options() : minify(false), max_depth(default_max_depth) {}
+    };
+
+    class canonicalizer
+    {
+        struct attribute_span
+        {
+            const char* name;
+            std::size_t name_length;
+            const char* value;
+            char quote;
+        };
+
+        canonical_options options;
+        std::vector<attribute_span> attributes;
+        const char* end;
+        std::string* out;
+
+        static bool is_namespace_declaration(const attribute_span& a)
+        {
+            return
+                a.name_length >= 5 &&
+                std::memcmp(a.name, "xmlns", 5) == 0 &&
+                (a.name_length == 5 || a.name[5] == ':');
+        }
+
+        static bool precedes(const attribute_span& a, const attribute_span& b)
+        {
+            bool a_ns = is_namespace_declaration(a);
+            bool b_ns = is_namespace_declaration(b);
+            if (a_ns != b_ns) return a_ns;
+
+            int order = std::memcmp(a.name, b.name, std::min(a.name_length, b.name_length));
+            return order < 0 || (order == 0 && a.name_length < b.name_length);
+        }
+
+        void put_utf8(int ch)
+        {
+            if (ch < 0x80) *out += static_cast<char>(ch);
+            else if (ch < 0x800)
+            {
+                *out += static_cast<char>(0xc0 | (ch >> 6));
+                *out += static_cast<char>(0x80 | (ch & 0x3f));
+            }
+            else if (ch < 0x10000)
+            {
+                *out += static_cast<char>(0xe0 | (ch >> 12));
+                *out += static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+                *out += static_cast<char>(0x80 | (ch & 0x3f));
+            }
+            else
+            {
+                *out += static_cast<char>(0xf0 | (ch >> 18));
+                *out += static_cast<char>(0x80 | ((ch >> 12) & 0x3f));
+                *out += static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+                *out += static_cast<char>(0x80 | (ch & 0x3f));
+            }
+        }
+
+        // Parses a reference following the "&" and returns its character.
+        static int parse_reference(const char*& c)
+        {
+            if (*c == '#')
+            {
+                ++c;
+                return parse_character_reference(c);
+            }
+            return parse_entity_reference(c);
+        }
+
+        void put_text_char(int ch)
+        {
+            switch (ch)
+            {
+            case '&': *out += "&amp;"; break;
+            case '<': *out += "&lt;"; break;
+            case '>': *out += "&gt;"; break;
+            case '\r': *out += "&#xD;"; break;
+            default: put_utf8(ch); break;
+            }
+        }
+
+        void put_attribute_char(int ch)
+        {
+            switch (ch)
+            {
+            case '&': *out += "&amp;"; break;
+            case '<': *out += "&lt;"; break;
+            case '"': *out += "&quot;"; break;
+            case '\t': *out += "&#x9;"; break;
+            case '\n': *out += "&#xA;"; break;
+            case '\r': *out += "&#xD;"; break;
+            default: put_utf8(ch); break;
+            }
+        }
+
+        // Writes character data up to the next "<", leaving c there.
+        void write_text(const char*& c)
+        {
+            while (true)
+            {
+                const char* run = c;
+                c = find_any<'<', '&', '>', '\r'>(c, end);
+                out->append(run, c);
+
+                switch (*c)
+                {
+                case '<':
+                    return;
+                case '&':
+                    ++c;
+                    put_text_char(parse_reference(c));
+                    break;
+                case '>':
+                    *out += "&gt;";
+                    ++c;
+                    break;
+                case '\r':
+                    *out += '\n';
+                    if (*++c == '\n') ++c;
+                    break;
+                default:
+                    throw parsing_exception(c);
+                }
+            }
+        }
+
+        // Writes the content of a CDATA section following the "<![CDATA[",
+        // leaving c following the "]]>".
+        void write_cdata(const char*& c)
+        {
+            const char* begin = c;
+            parse_cdata_content_end(c);
+            const char* content_end = c - 3;
+
+            while (begin != content_end)
+            {
+                const char* run = begin;
+                begin = find_any<'&', '<', '>', '\r'>(begin, content_end);
+                out->append(run, begin);
+                if (begin == content_end) break;
+
+                if (*begin == '\r')
+                {
+                    *out += '\n';
+                    if (++begin != content_end && *begin == '\n') ++begin;
+                }
+                else put_text_char(*begin++);
+            }
+        }
+
+        void write_attribute_value(const attribute_span& a)
+        {
+            const char* c = a.value;
+            while (true)
+            {
+                const char* run = c;
+                c = find_any<'"', '\'', '&', '<', '\t', '\n', '\r'>(c, end);
+                out->append(run, c);
+
+                char ch = *c;
+                if (ch == a.quote) return;
+                ++c;
+                switch (ch)
+                {
+                case '\'':
+                    *out += '\'';
+                    break;
+                case '"':
+                    *out += "&quot;";
+                    break;
+                case '&':
+                    put_attribute_char(parse_reference(c));
+                    break;
+                case '\t':
+                case '\n':
+                    *out += ' ';
+                    break;
+                case '\r':
+                    *out += ' ';
+                    if (*c == '\n') ++c;
+                    break;
+                default:
+                    throw parsing_exception(c);
+                }
+            }
+        }
+
+        // Skips whitespace (when minifying) and comments following c, and
+        // returns true if what follows is an end tag, i.e., the element has
+        // no content once those are dropped.  c is left unchanged.
+        bool content_is_empty(const char* c) const
+        {
+            if (options.minify) return text_is_whitespace(c) && c[1] == '/';
+
+            while (true)
+            {
+                if (*c != '<') return false;
+                ++c;
+                if (*c == '/') return true;
+                if (!match_literal<'!', '-', '-'>(c)) return false;
+                parse_comment_content_end(c);
+            }
+        }
+
+        // Returns true if the text from c up to the next start or end tag is
+        // only whitespace, including the content of any CDATA sections, and
+        // skipping comments.  If so, c is left at the "<" of that tag.
+        static bool text_is_whitespace(const char*& c)
+        {
+            const char* p = c;
+            while (true)
+            {
+                parse_whitespace(p);
+                if (*p != '<') return false;
+
+                const char* q = p + 1;
+                if (match_literal<'!', '-', '-'>(q)) parse_comment_content_end(q);
+                else if (match_literal<'!', '[', 'C', 'D', 'A', 'T', 'A', '['>(q))
+                {
+                    parse_whitespace(q);
+                    if (!match_literal<']', ']', '>'>(q)) return false;
+                }
+                else
+                {
+                    c = p;
+                    return true;
+                }
+                p = q;
+            }
+        }
+
+        // Writes the start tag whose name c follows the "<" of, and returns
+        // true if the element has content to write.  Otherwise the end tag
+        // has been written and c follows the element.
+        bool write_start_tag(const char*& c)
+        {
+            const char* name = c;
+            parse_name(c);
+            std::size_t name_length = static_cast<std::size_t>(c - name);
+            *out += '<';
+            out->append(name, name_length);
+
+            attributes.clear();
+            parse_whitespace(c);
+            while (*c != '/' && *c != '>')
+            {
+                attribute_span a;
+                a.name = c;
+                parse_attribute_name(c);
+                a.name_length = static_cast<std::size_t>(c - a.name);
+                parse_whitespace(c);
+                parse<'='>(c);
+                parse_whitespace(c);
+                a.quote = *c;
+                a.value = c + 1;
+                parse_attribute_value(c);
+                attributes.push_back(a);
+                parse_whitespace(c);
+            }
+
+            std::sort(attributes.begin(), attributes.end(), precedes);
+            for (std::size_t i = 0; i < attributes.size(); ++i)
+            {
+                const attribute_span& a = attributes[i];
+                if (i > 0 &&
+                    a.name_length == attributes[i - 1].name_length &&
+                    std::memcmp(a.name, attributes[i - 1].name, a.name_length) == 0)
+                {
+                    throw parsing_exception(c);
+                }
+
+                *out += ' ';
+                out->append(a.name, a.name_length);
+                *out += "=\"";
+                write_attribute_value(a);
+                *out += '"';
+            }
+
+            bool content = parse_start_tag_end(c);
+            if (content && !content_is_empty(c))
+            {
+                *out += '>';
+                return true;
+            }
+
+            if (content)
+            {
+                // Skip over the dropped content and the end tag.
+                parse_element_text(c);
+                parse<'/'>(c);
+                parse_name(c);
+                parse_whitespace(c);
+                parse<'>'>(c);
+            }
+
+            if (options.minify) *out += "/>";
+            else
+            {
+                *out += "></";
+                out->append(name, name_length);
+                *out += '>';
+            }
+            return false;
+        }
+
+    public:
+        explicit canonicalizer(const canonical_options& o = canonical_options()) :
+            options(o), end(nullptr), out(nullptr)
+        {
+        }
+
+        // Appends the canonical form of the document at doc to result.  doc
+        // must be NUL-terminated, with size the position of the NUL.
+        void write(const char* doc, std::size_t size, std::string& result)
+        {
+            out = &result;
+            end = doc + size;
+            out->reserve(out->size() + size);
+
+            const char* c = doc;
+            parse_prolog(c);
+
+            std::size_t depth = 0;
+            if (write_start_tag(c)) ++depth;
+
+            // Whether c is at the start of a text node, i.e., follows a tag
+            // rather than a comment or CDATA section within the text.
+            bool text_start = true;
+
+            while (depth > 0)
+            {
+                // Content up to the next tag.  When minifying, a text node
+                // that is only whitespace is dropped as a whole, along with
+                // its comments and CDATA sections.
+                if (options.minify && text_start) text_is_whitespace(c);
+                text_start = true;
+                write_text(c);
+                ++c;
+
+                if (*c == '/')
+                {
+                    ++c;
+                    const char* name = c;
+                    parse_name(c);
+                    *out += "</";
+                    out->append(name, c);
+                    *out += '>';
+                    parse_whitespace(c);
+                    parse<'>'>(c);
+                    --depth;
+                }
+                else if (*c == '!')
+                {
+                    ++c;
+                    text_start = false;
+                    if (*c == '-')
+                    {
+                        parse_literal<'-', '-'>(c);
+                        parse_comment_content_end(c);
+                    }
+                    else
+                    {
+                        parse_literal<'[', 'C', 'D', 'A', 'T', 'A', '['>(c);
+                        write_cdata(c);
+                    }
+                }
+                else if (write_start_tag(c))
+                {
+                    if (++depth > options.max_depth) throw depth_limit_exception(c);
+                }
+            }
+        }
+    };
+
+    // Returns the canonical form of a document; see canonicalizer::write.
+    inline std::string canonicalize(const char* doc, std::size_t size)
+    {
+        std::string result;
+        canonicalizer().write(doc, size, result);
+        return result;
+    }
+
+    inline std::string minify(const char* doc, std::size_t size)
+    {
+        canonical_options options;
+        options.minify = true;
+
+        std::string result;
+        canonicalizer(options).write(doc, size, result);
+        return result;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,337 @@
+#pragma once
+
+#include "intxml_block.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <istream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#ifdef INTXML_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// This file implements a block source (see intxml_block.h) that decompresses
+// gzip or zlib and, when built with INTXML_HAVE_ZSTD, zstd input.  Decompression
+// runs on a background thread into a fixed ring of large blocks, so it
+// overlaps with parsing and memory use is bounded by the ring regardless of
+// the document size.  The format is detected from the first bytes of the
+// input; anything unrecognized is passed through unchanged.  Requires linking
+// with zlib (and libzstd).
+
+namespace intxml
+{
+    class decompress_exception : public std::exception
+    {
+    };
+
+    class decompressing_source
+    {
+        enum format_t { plain, gzip, zlib, zstd };
+
+        struct block
+        {
+            std::vector<char> data;
+            std::size_t size;
+        };
+
+        std::istream& input;
+        std::vector<char> in;
+        std::size_t in_pos;
+        std::size_t in_size;
+
+        std::vector<block> blocks;
+        std::size_t filled;
+        std::size_t taken;
+        std::size_t released;
+        bool done;
+        bool stop;
+        std::exception_ptr error;
+        std::mutex lock;
+        std::condition_variable ready;
+        std::condition_variable space;
+        std::thread worker;
+
+        // Refills the compressed input buffer.  Returns false at the end of
+        // the input.
+        bool read_input()
+        {
+            input.read(in.data(), in.size());
+            in_pos = 0;
+            in_size = static_cast<std::size_t>(input.gcount());
+            return in_size > 0;
+        }
+
+        // Waits for a free block and returns it, or returns null if the
+        // consumer has gone away.
+        block* acquire()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            space.wait(guard, [this] { return stop || filled - released < blocks.size(); });
+            return stop ? nullptr : &blocks[filled % blocks.size()];
+        }
+
+        void publish()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ++filled;
+            ready.notify_one();
+        }
+
+        // Each decoder fills blocks until the input is exhausted.  They
+        // return early if the consumer stops.
+        void run_plain()
+        {
+            block* b;
+            do
+            {
+                if (!(b = acquire())) return;
+                b->size = 0;
+                while (b->size < b->data.size())
+                {
+                    if (in_pos == in_size && !read_input()) break;
+                    std::size_t n = std::min(in_size - in_pos, b->data.size() - b->size);
+                    std::copy(&in[in_pos], &in[in_pos] + n, &b->data[b->size]);
+                    in_pos += n;
+                    b->size += n;
+                }
+                if (b->size) publish();
+            } while (b->size == b->data.size());
+        }
+
+        // Decodes gzip or zlib input; inflate detects which from the header.
+        void run_gzip()
+        {
+            z_stream zs = z_stream();
+            if (inflateInit2(&zs, 15 + 32) != Z_OK) throw decompress_exception();
+
+            try
+            {
+                // The input may only end once a member has ended and all
+                // of its output has been delivered.
+                bool more = true;
+                bool at_eof = false;
+                bool ended = false;
+                block* b;
+                while (more && (b = acquire()))
+                {
+                    zs.next_out = reinterpret_cast<Bytef*>(b->data.data());
+                    zs.avail_out = static_cast<uInt>(b->data.size());
+
+                    while (zs.avail_out > 0)
+                    {
+                        if (zs.avail_in == 0 && !at_eof)
+                        {
+                            if (in_pos == in_size && !read_input()) at_eof = true;
+                            else
+                            {
+                                zs.next_in = reinterpret_cast<Bytef*>(&in[in_pos]);
+                                zs.avail_in = static_cast<uInt>(in_size - in_pos);
+                                in_pos = in_size;
+                            }
+                        }
+                        if (at_eof && ended)
+                        {
+                            more = false;
+                            break;
+                        }
+
+                        int result = inflate(&zs, Z_NO_FLUSH);
+                        if (result == Z_STREAM_END)
+                        {
+                            // Concatenated gzip members are decoded as one
+                            // stream, as gunzip does.
+                            ended = true;
+                            if (inflateReset(&zs) != Z_OK) throw decompress_exception();
+                        }
+                        else if (result == Z_OK) ended = false;
+                        else if (result != Z_BUF_ERROR || at_eof)
+                        {
+                            // With no input left, no progress means the
+                            // member was cut short.
+                            throw decompress_exception();
+                        }
+                    }
+
+                    b->size = b->data.size() - zs.avail_out;
+                    if (b->size) publish();
+                }
+            }
+            catch (...)
+            {
+                inflateEnd(&zs);
+                throw;
+            }
+
+            inflateEnd(&zs);
+        }
+
+#ifdef INTXML_HAVE_ZSTD
+        void run_zstd()
+        {
+            ZSTD_DCtx* dctx = ZSTD_createDCtx();
+            if (!dctx) throw decompress_exception();
+
+            try
+            {
+                // ZSTD_decompressStream returns 0 once a frame has been
+                // decoded and flushed, and the input may only end there.
+                ZSTD_inBuffer zin = { in.data(), in_size, in_pos };
+                bool more = true;
+                bool at_eof = false;
+                std::size_t hint = 1;
+                block* b;
+                while (more && (b = acquire()))
+                {
+                    ZSTD_outBuffer zout = { b->data.data(), b->data.size(), 0 };
+
+                    while (zout.pos < zout.size)
+                    {
+                        if (zin.pos == zin.size && !at_eof)
+                        {
+                            if (!read_input()) at_eof = true;
+                            else
+                            {
+                                zin.size = in_size;
+                                zin.pos = 0;
+                            }
+                        }
+                        if (at_eof && hint == 0)
+                        {
+                            more = false;
+                            break;
+                        }
+
+                        std::size_t before = zout.pos;
+                        hint = ZSTD_decompressStream(dctx, &zout, &zin);
+                        if (ZSTD_isError(hint) || (at_eof && hint != 0 && zout.pos == before))
+                        {
+                            throw decompress_exception();
+                        }
+                    }
+
+                    b->size = zout.pos;
+                    if (b->size) publish();
+                }
+            }
+            catch (...)
+            {
+                ZSTD_freeDCtx(dctx);
+                throw;
+            }
+
+            ZSTD_freeDCtx(dctx);
+        }
+#endif
+
+        void run()
+        {
+            try
+            {
+                read_input();
+
+                const unsigned char* magic = reinterpret_cast<const unsigned char*>(in.data());
+                format_t format = plain;
+                if (in_size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) format = gzip;
+                // A zlib header names deflate with at most a 32K window, and
+                // its two bytes are a multiple of 31.  No XML document starts
+                // with such a byte.
+                else if (in_size >= 2 &&
+                    (magic[0] & 0x0f) == 8 && (magic[0] >> 4) <= 7 &&
+                    (magic[0] * 256 + magic[1]) % 31 == 0) format = zlib;
+                else if (in_size >= 4 &&
+                    magic[0] == 0x28 && magic[1] == 0xb5 &&
+                    magic[2] == 0x2f && magic[3] == 0xfd) format = zstd;
+
+                switch (format)
+                {
+                case gzip:
+                case zlib: run_gzip(); break;
+#ifdef INTXML_HAVE_ZSTD
+                case zstd: run_zstd(); break;
+#else
+                case zstd: throw decompress_exception();
+#endif
+                default: run_plain(); break;
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            done = true;
+            ready.notify_one();
+        }
+
+    public:
+        // Starts decompressing immediately.  At most block_count blocks of
+        // block_size bytes are held at any time, including the one being
+        // parsed.
+        decompressing_source(
+            std::istream& istr,
+            std::size_t block_size = 1 << 20,
+            std::size_t block_count = 4) :
+            input(istr),
+            in(block_size),
+            in_pos(0),
+            in_size(0),
+            blocks(block_count < 2 ? 2 : block_count),
+            filled(0),
+            taken(0),
+            released(0),
+            done(false),
+            stop(false)
+        {
+            for (block& b : blocks) b.data.resize(block_size);
+            worker = std::thread([this] { run(); });
+        }
+
+        ~decompressing_source()
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stop = true;
+                space.notify_one();
+            }
+            worker.join();
+        }
+
+        decompressing_source(const decompressing_source&) = delete;
+        decompressing_source& operator=(const decompressing_source&) = delete;
+
+        // Returns the next block of decompressed data, handing the previous
+        // one back to the background thread.  Rethrows any error raised while
+        // decompressing.
+        bool next_block(const char*& begin, const char*& end)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+
+            if (taken > released)
+            {
+                ++released;
+                space.notify_one();
+            }
+
+            ready.wait(guard, [this] { return filled > taken || done; });
+
+            if (filled > taken)
+            {
+                const block& b = blocks[taken++ % blocks.size()];
+                begin = b.data.data();
+                end = begin + b.size;
+                return true;
+            }
+
+            if (error) std::rethrow_exception(error);
+            return false;
+        }
+    };
+
+    typedef block_iterator<decompressing_source> decompressing_iterator;
+}
\ No newline at end of file
@@ -0,0 +1,306 @@
+#pragma once
+
+#include "intxml_block.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef INTXML_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// This file implements a block source (see intxml_block.h) that reads a file
+// with a configurable number of large reads in flight ahead of the parser.
+// Blocks are read straight into a ring of buffers that are handed to the
+// parser without copying; a buffer is reused for the block ahead once the
+// parser asks for the block after it.  Reads are issued through io_uring when
+// built with INTXML_HAVE_LIBURING, and otherwise by a small pool of threads
+// calling pread.  POSIX only.
+
+namespace intxml
+{
+    class file_source_exception : public std::exception
+    {
+    };
+
+    class readahead_file_source
+    {
+        struct slot
+        {
+            std::vector<char> data;
+            std::uint64_t block;
+            std::size_t expected;
+            std::size_t size;
+            bool ready;
+            bool failed;
+        };
+
+        int fd;
+        std::uint64_t file_size;
+        std::size_t block_size;
+        std::uint64_t block_count;
+        std::vector<slot> slots;
+        std::uint64_t next;
+
+#ifdef INTXML_HAVE_LIBURING
+        io_uring ring;
+        std::size_t in_flight;
+
+        void submit(slot& s)
+        {
+            io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+            if (!sqe) throw file_source_exception();
+            io_uring_prep_read(
+                sqe, fd, s.data.data() + s.size,
+                static_cast<unsigned>(s.expected - s.size),
+                s.block * block_size + s.size);
+            io_uring_sqe_set_data(sqe, &s);
+            if (io_uring_submit(&ring) < 0) throw file_source_exception();
+            ++in_flight;
+        }
+
+        // Reaps one completion, resubmitting the remainder of short reads.
+        void complete()
+        {
+            io_uring_cqe* cqe;
+            if (io_uring_wait_cqe(&ring, &cqe) < 0) throw file_source_exception();
+            slot& s = *static_cast<slot*>(io_uring_cqe_get_data(cqe));
+            int result = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+            --in_flight;
+
+            if (result <= 0) s.failed = true;
+            else
+            {
+                s.size += result;
+                if (s.size < s.expected) return submit(s);
+            }
+            s.ready = true;
+        }
+
+        void start()
+        {
+            in_flight = 0;
+            if (io_uring_queue_init(static_cast<unsigned>(slots.size()), &ring, 0) < 0)
+            {
+                throw file_source_exception();
+            }
+        }
+
+        void finish()
+        {
+            while (in_flight)
+            {
+                io_uring_cqe* cqe;
+                if (io_uring_wait_cqe(&ring, &cqe) < 0) break;
+                io_uring_cqe_seen(&ring, cqe);
+                --in_flight;
+            }
+            io_uring_queue_exit(&ring);
+        }
+
+        void wait(slot& s)
+        {
+            while (!s.ready) complete();
+        }
+#else
+        std::deque<slot*> jobs;
+        std::vector<std::thread> readers;
+        std::mutex lock;
+        std::condition_variable work;
+        std::condition_variable ready;
+        bool stop;
+
+        void submit(slot& s)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(&s);
+            work.notify_one();
+        }
+
+        void read(slot& s)
+        {
+            while (s.size < s.expected)
+            {
+                ssize_t result = ::pread(
+                    fd, s.data.data() + s.size, s.expected - s.size,
+                    static_cast<off_t>(s.block * block_size + s.size));
+                if (result <= 0)
+                {
+                    s.failed = true;
+                    break;
+                }
+                s.size += static_cast<std::size_t>(result);
+            }
+        }
+
+        void run()
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (true)
+            {
+                work.wait(guard, [this] { return stop || !jobs.empty(); });
+                if (stop) return;
+
+                slot& s = *jobs.front();
+                jobs.pop_front();
+
+                guard.unlock();
+                read(s);
+                guard.lock();
+
+                s.ready = true;
+                ready.notify_all();
+            }
+        }
+
+        // Readers started before a failure are shut down again.
+        void start(std::size_t threads)
+        {
+            stop = false;
+            try
+            {
+                for (std::size_t i = 0; i < threads; ++i)
+                {
+                    readers.emplace_back([this] { run(); });
+                }
+            }
+            catch (...)
+            {
+                finish();
+                throw;
+            }
+        }
+
+        void finish()
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stop = true;
+                work.notify_all();
+            }
+            for (std::thread& t : readers) t.join();
+        }
+
+        void wait(slot& s)
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            ready.wait(guard, [&s] { return s.ready; });
+        }
+#endif
+
+        // Queues block b into its slot, if b is within the file.
+        void request(std::uint64_t b)
+        {
+            if (b >= block_count) return;
+
+            slot& s = slots[b % slots.size()];
+            s.block = b;
+            s.expected = static_cast<std::size_t>(
+                std::min<std::uint64_t>(block_size, file_size - b * block_size));
+            s.size = 0;
+            s.ready = false;
+            s.failed = false;
+            submit(s);
+        }
+
+    public:
+        // Opens the file and immediately issues reads for the first
+        // blocks_ahead blocks.  reader_threads is only used by the pread
+        // fallback.
+        readahead_file_source(
+            const char* path,
+            std::size_t block_size = 1 << 20,
+            std::size_t blocks_ahead = 8,
+            std::size_t reader_threads = 4) :
+            fd(::open(path, O_RDONLY)),
+            file_size(0),
+            block_size(block_size ? block_size : 1),
+            block_count(0),
+            slots(blocks_ahead < 2 ? 2 : blocks_ahead),
+            next(0)
+        {
+            if (fd < 0) throw file_source_exception();
+
+            struct stat info;
+            if (::fstat(fd, &info) < 0)
+            {
+                ::close(fd);
+                throw file_source_exception();
+            }
+            file_size = static_cast<std::uint64_t>(info.st_size);
+            block_count = (file_size + this->block_size - 1) / this->block_size;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+            try
+            {
+                for (slot& s : slots) s.data.resize(this->block_size);
+#ifdef INTXML_HAVE_LIBURING
+                (void)reader_threads;
+                start();
+#else
+                start(reader_threads ? reader_threads : 1);
+#endif
+            }
+            catch (...)
+            {
+                ::close(fd);
+                throw;
+            }
+
+            // Once the readers are running, they have to be shut down
+            // before the exception leaves, since the destructor won't run.
+            try
+            {
+                for (std::uint64_t b = 0; b < slots.size(); ++b) request(b);
+            }
+            catch (...)
+            {
+                finish();
+                ::close(fd);
+                throw;
+            }
+        }
+
+        ~readahead_file_source()
+        {
+            finish();
+            ::close(fd);
+        }
+
+        readahead_file_source(const readahead_file_source&) = delete;
+        readahead_file_source& operator=(const readahead_file_source&) = delete;
+
+        std::uint64_t size() const { return file_size; }
+
+        // Returns the next block, waiting for its read if necessary.  The
+        // previous block's buffer is reused to read ahead.
+        bool next_block(const char*& begin, const char*& end)
+        {
+            if (next > 0) request(next - 1 + slots.size());
+            if (next == block_count) return false;
+
+            slot& s = slots[next % slots.size()];
+            wait(s);
+            if (s.failed) throw file_source_exception();
+
+            begin = s.data.data();
+            end = begin + s.size;
+            ++next;
+            return true;
+        }
+    };
+
+    typedef block_iterator<readahead_file_source> readahead_file_iterator;
+}
\ No newline at end of file
@@ -0,0 +1,412 @@
+#pragma once
+
+#include "intxml_index.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <unordered_set>
+#include <vector>
+
+// This file implements hashing of every element subtree of a document in a
+// single pass, for finding what changed between two versions of a document
+// without comparing their text.
+//
+// The hash of an element covers its name, its attributes (names and raw
+// values, in document order) and its content: runs of text (with CDATA
+// sections included as written and comments left out) and the hashes of its
+// children.  Whitespace within tags and comments don't affect it, but
+// differences in how characters are written, e.g., "&#38;" vs "&amp;", do.
+// Hashes are computed bottom-up, one open hash state per open element, so
+// the document is scanned once regardless of depth.
+//
+// Entries are in document order, the same order as structural_index, so
+// entry i of both describes the same element.  The hashes can be saved to
+// a sidecar file, tagged with the source document and the seed like the
+// structural index, and reused while the document is unchanged.
+
+namespace intxml
+{
+    // Streaming 64-bit hash, consuming input 8 bytes at a time with the
+    // round and final mix of xxHash64.  Not intended to resist deliberate
+    // collisions.
+    class stream_hash
+    {
+        static const std::uint64_t prime1 = 11400714785074694791ull;
+        static const std::uint64_t prime2 = 14029467366897019727ull;
+        static const std::uint64_t prime3 = 1609587929392839161ull;
+
+        std::uint64_t acc;
+        std::uint64_t pending;
+        unsigned pending_count;
+        std::uint64_t length;
+
+        static std::uint64_t rotl(std::uint64_t x, unsigned r)
+        {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        void round(std::uint64_t word)
+        {
+            acc ^= word * prime2;
+            acc = rotl(acc, 31) * prime1;
+        }
+
+    public:
+        explicit stream_hash(std::uint64_t seed = 0) :
+            acc(seed + prime3), pending(0), pending_count(0), length(0)
+        {
+        }
+
+        void update(const char* p, std::size_t n)
+        {
+            length += n;
+
+            while (pending_count != 0 && n != 0)
+            {
+                pending |= static_cast<std::uint64_t>(static_cast<unsigned char>(*p++)) << (8 * pending_count);
+                --n;
+                if (++pending_count == 8)
+                {
+                    round(pending);
+                    pending = 0;
+                    pending_count = 0;
+                }
+            }
+
+            for (; n >= 8; n -= 8, p += 8)
+            {
+                std::uint64_t word;
+                std::memcpy(&word, p, 8);
+                round(word);
+            }
+
+            for (; n != 0; --n)
+            {
+                pending |= static_cast<std::uint64_t>(static_cast<unsigned char>(*p++)) << (8 * pending_count++);
+            }
+        }
+
+        void update(std::uint64_t word)
+        {
+            char bytes[8];
+            std::memcpy(bytes, &word, 8);
+            update(bytes, 8);
+        }
+
+        void update(char tag)
+        {
+            update(&tag, 1);
+        }
+
+        std::uint64_t digest() const
+        {
+            std::uint64_t h = acc;
+            if (pending_count != 0)
+            {
+                h ^= pending * prime1;
+                h = rotl(h, 23) * prime2;
+            }
+            h ^= length;
+            h ^= h >> 33;
+            h *= prime2;
+            h ^= h >> 29;
+            h *= prime3;
+            h ^= h >> 32;
+            return h;
+        }
+    };
+
+    // Hashes are 32 bytes.  As in structural_index, the subtree of entry i
+    // is entries [i, i + subtree_size).
+    struct subtree_hash
+    {
+        // Offset of the "<" of the start tag.
+        std::uint64_t start;
+
+        // Offset just past the end tag, or the "/>" of an empty element.
+        std::uint64_t end;
+
+        std::uint64_t hash;
+        std::uint32_t depth;
+        std::uint32_t subtree_size;
+    };
+
+    struct subtree_hash_options
+    {
+        std::uint64_t seed;
+        std::size_t max_depth;
+
+        // Leaves text consisting only of whitespace out of the hash, so
+        // that reindenting a document doesn't change it.
+        bool ignore_whitespace_text;
+
+        subtree_hash_options() : seed(0), max_depth(default_max_depth), ignore_whitespace_text(false) {}
+    };
+
+    class subtree_hashes
+    {
+        struct header
+        {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t entry_size;
+            source_info source;
+            std::uint64_t seed;
+            std::uint64_t count;
+            std::uint64_t flags;
+        };
+
+        struct open_element
+        {
+            stream_hash hash;
+            std::uint32_t index;
+
+            // Length of the text run being hashed, which ends at the next
+            // child or the end tag.
+            std::uint64_t text_length;
+        };
+
+        std::vector<subtree_hash> entries;
+        subtree_hash_options options;
+
+        static void set_magic(header& h, const subtree_hash_options& o)
+        {
+            std::memcpy(h.magic, "IXMLHSH", 8);
+            h.version = 1;
+            h.entry_size = sizeof(subtree_hash);
+            h.seed = o.seed;
+            h.flags = o.ignore_whitespace_text ? 1 : 0;
+        }
+
+        static void end_text(open_element& e)
+        {
+            if (e.text_length != 0)
+            {
+                e.hash.update(e.text_length);
+                e.text_length = 0;
+            }
+        }
+
+        static void add_text(open_element& e, const char* begin, const char* end)
+        {
+            if (begin == end) return;
+            if (e.text_length == 0) e.hash.update('T');
+            e.hash.update(begin, static_cast<std::size_t>(end - begin));
+            e.text_length += static_cast<std::uint64_t>(end - begin);
+        }
+
+    public:
+        subtree_hashes() {}
+
+        // Scans the document at doc, which must be NUL-terminated, and
+        // hashes each of its elements.
+        static subtree_hashes build(const char* doc, const subtree_hash_options& o = subtree_hash_options())
+        {
+            subtree_hashes result;
+            result.options = o;
+            std::vector<subtree_hash>& entries = result.entries;
+            std::vector<open_element> open;
+
+            const char* c = doc;
+            parse_prolog(c);
+
+            while (true)
+            {
+                // Start tag, with c following the "<".
+                open_element e = { stream_hash(o.seed), static_cast<std::uint32_t>(entries.size()), 0 };
+                subtree_hash entry = { static_cast<std::uint64_t>(c - 1 - doc), 0, 0, static_cast<std::uint32_t>(open.size()), 1 };
+                entries.push_back(entry);
+
+                const char* name = c;
+                parse_name(c);
+                e.hash.update('N');
+                e.hash.update(name, static_cast<std::size_t>(c - name));
+                e.hash.update(static_cast<std::uint64_t>(c - name));
+
+                parse_whitespace(c);
+                while (*c != '/' && *c != '>')
+                {
+                    name = c;
+                    parse_attribute_name(c);
+                    e.hash.update('A');
+                    e.hash.update(name, static_cast<std::size_t>(c - name));
+                    e.hash.update(static_cast<std::uint64_t>(c - name));
+
+                    parse_whitespace(c);
+                    parse<'='>(c);
+                    parse_whitespace(c);
+                    const char* value = c + 1;
+                    parse_attribute_value(c);
+                    e.hash.update(value, static_cast<std::size_t>(c - 1 - value));
+                    e.hash.update(static_cast<std::uint64_t>(c - 1 - value));
+                    parse_whitespace(c);
+                }
+                open.push_back(e);
+
+                bool content = parse_start_tag_end(c);
+                if (content && open.size() > o.max_depth) throw depth_limit_exception(c);
+                while (true)
+                {
+                    if (content)
+                    {
+                        // Text and comments up to the next child or end tag.
+                        open_element& top = open.back();
+                        while (true)
+                        {
+                            const char* text = c;
+                            parse_element_value(c);
+                            if (o.ignore_whitespace_text)
+                            {
+                                const char* p = text;
+                                parse_whitespace(p);
+                                if (p == c) text = c;
+                            }
+                            add_text(top, text, c);
+
+                            if (*c != '<') throw parsing_exception(c);
+                            ++c;
+                            if (*c != '!') break;
+
+                            ++c;
+                            if (*c == '-')
+                            {
+                                parse_literal<'-', '-'>(c);
+                                parse_comment_content_end(c);
+                            }
+                            else
+                            {
+                                parse_literal<'[', 'C', 'D', 'A', 'T', 'A', '['>(c);
+                                const char* cdata = c;
+                                parse_cdata_content_end(c);
+                                add_text(top, cdata, c - 3);
+                            }
+                        }
+                        end_text(top);
+
+                        if (*c != '/') break;
+                        ++c;
+                        parse_name(c);
+                        parse<'>'>(c);
+                    }
+
+                    // The element on top of the stack has ended.
+                    open_element& done = open.back();
+                    subtree_hash& finished = entries[done.index];
+                    finished.end = static_cast<std::uint64_t>(c - doc);
+                    finished.hash = done.hash.digest();
+                    finished.subtree_size = static_cast<std::uint32_t>(entries.size() - done.index);
+                    open.pop_back();
+
+                    if (open.empty()) return result;
+                    open.back().hash.update('C');
+                    open.back().hash.update(finished.hash);
+                    content = true;
+                }
+            }
+        }
+
+        // Writes the hashes to a sidecar file, replacing it atomically.
+        // Returns false on failure.
+        bool save(const char* path, const source_info& source) const
+        {
+            header h;
+            set_magic(h, options);
+            h.source = source;
+            h.count = entries.size();
+            return write_sidecar(path, &h, sizeof(h), entries.data(), sizeof(subtree_hash), entries.size());
+        }
+
+        // Reads a sidecar file written by save().  Returns false, leaving the
+        // hashes empty, if the file is missing or malformed, or was written
+        // for a different version of the source or with other options.
+        bool load(const char* path, const source_info& source, const subtree_hash_options& o = subtree_hash_options())
+        {
+            entries.clear();
+            options = o;
+
+            std::FILE* f = std::fopen(path, "rb");
+            if (!f) return false;
+
+            // The count is checked against the size of the file before
+            // anything is allocated for the entries.
+            struct stat info;
+            header h;
+            header expected;
+            set_magic(expected, o);
+            bool ok =
+                ::fstat(::fileno(f), &info) == 0 &&
+                static_cast<std::size_t>(info.st_size) >= sizeof(header) &&
+                std::fread(&h, sizeof(h), 1, f) == 1 &&
+                std::memcmp(h.magic, expected.magic, sizeof(h.magic)) == 0 &&
+                h.version == expected.version &&
+                h.entry_size == expected.entry_size &&
+                h.seed == expected.seed &&
+                h.flags == expected.flags &&
+                h.source == source &&
+                h.count == (static_cast<std::size_t>(info.st_size) - sizeof(header)) / sizeof(subtree_hash);
+
+            if (ok)
+            {
+                entries.resize(static_cast<std::size_t>(h.count));
+                ok = std::fread(entries.data(), sizeof(subtree_hash), entries.size(), f) == entries.size();
+            }
+
+            std::fclose(f);
+            if (!ok) entries.clear();
+            return ok;
+        }
+
+        // Loads the sidecar for the document at source_path if it is up to
+        // date, and otherwise hashes doc (the contents of that file) and
+        // rewrites the sidecar.
+        static subtree_hashes open_or_build(
+            const char* doc,
+            const char* source_path,
+            const char* hash_path,
+            const subtree_hash_options& o = subtree_hash_options())
+        {
+            subtree_hashes hashes;
+            source_info source;
+            if (!source.read(source_path)) return build(doc, o);
+            if (hashes.load(hash_path, source, o)) return hashes;
+
+            hashes = build(doc, o);
+            hashes.save(hash_path, source);
+            return hashes;
+        }
+
+        std::size_t size() const { return entries.size(); }
+
+        bool empty() const { return entries.empty(); }
+
+        const subtree_hash& operator[](std::size_t i) const { return entries[i]; }
+
+        const subtree_hash* begin() const { return entries.data(); }
+
+        const subtree_hash* end() const { return entries.data() + entries.size(); }
+    };
+
+    // Calls h(i) for each element i of current whose subtree doesn't occur
+    // anywhere in previous, outermost first.  The subtrees of elements that
+    // do occur are skipped.  With the arguments swapped, this finds what was
+    // removed.  Both must have been built with the same options.
+    template <typename handler>
+    void find_unmatched(const subtree_hashes& previous, const subtree_hashes& current, handler h)
+    {
+        std::unordered_set<std::uint64_t> known;
+        known.reserve(previous.size());
+        for (const subtree_hash& e : previous) known.insert(e.hash);
+
+        std::size_t i = 0;
+        while (i < current.size())
+        {
+            if (known.count(current[i].hash)) i += current[i].subtree_size;
+            else
+            {
+                h(i);
+                ++i;
+            }
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,610 @@
+#pragma once
+
+#include "intxml_parser.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// This file implements an element index of a document that is kept up to
+// date as the document is edited, without reparsing all of it.  It records
+// the same information as structural_index (see intxml_index.h), except for
+// parent links, and is meant for documents held in memory and changed in
+// place, e.g., by an editor.
+//
+// After each edit, update() is given the edited document and the edited
+// byte range.  It reparses the innermost element enclosing the range, and
+// accepts the result if that element now ends exactly where its old end
+// has moved to; since everything outside it is unchanged, the rest of the
+// index still holds.  Otherwise it retries with the enclosing element, and
+// finally rebuilds the index.  The new entries replace those of the old
+// subtree, and the ends and subtree sizes of its ancestors are adjusted.
+// The first attempt is narrower: only the content of that element from the
+// last child ending before the edit to the first child starting after it is
+// reparsed, and the children in between are replaced, so that inserting or
+// deleting a record in a long list doesn't reparse the list.
+//
+// Entries are kept in blocks of a few thousand, each with a pending offset
+// shift and an entry count held in Fenwick trees, so that moving everything
+// after the edit and finding an entry by number both take O(log n) steps
+// rather than O(n).  An edit therefore costs time proportional to the
+// reparsed subtree and one block, plus the depth of the element.  Parents
+// aren't stored, since inserting entries would change the parent numbers of
+// all later siblings; parent() finds them by scanning back, skipping over
+// blocks that hold no shallower elements.
+
+namespace intxml
+{
+    struct incremental_entry
+    {
+        // Offset of the "<" of the start tag.
+        std::uint64_t start;
+
+        // Offset just past the end tag, or the "/>" of an empty element.
+        std::uint64_t end;
+
+        std::uint32_t depth;
+
+        // Hash of the name, as computed by parse_name_hashed.
+        std::uint32_t name_hash;
+
+        // Number of entries in the subtree, including this one.
+        std::uint32_t subtree_size;
+    };
+
+    // Prefix sums over an array that can be updated in O(log n).
+    class fenwick_tree
+    {
+        std::vector<std::int64_t> tree;
+
+    public:
+        fenwick_tree() : tree(1, 0) {}
+
+        explicit fenwick_tree(const std::vector<std::int64_t>& values) : tree(values.size() + 1, 0)
+        {
+            for (std::size_t i = 1; i < tree.size(); ++i)
+            {
+                tree[i] += values[i - 1];
+                std::size_t up = i + (i & (0 - i));
+                if (up < tree.size()) tree[up] += tree[i];
+            }
+        }
+
+        std::size_t size() const { return tree.size() - 1; }
+
+        // Adds v to value i.
+        void add(std::size_t i, std::int64_t v)
+        {
+            for (++i; i < tree.size(); i += i & (0 - i)) tree[i] += v;
+        }
+
+        // Returns the sum of values [0, i].
+        std::int64_t prefix(std::size_t i) const
+        {
+            std::int64_t sum = 0;
+            for (++i; i > 0; i -= i & (0 - i)) sum += tree[i];
+            return sum;
+        }
+
+        // Returns the first i for which prefix(i) > v, or size() if there is
+        // none.  The values must not be negative.
+        std::size_t upper_bound(std::int64_t v) const
+        {
+            std::size_t step = 1;
+            while (step * 2 < tree.size()) step *= 2;
+
+            std::size_t i = 0;
+            for (; step > 0; step /= 2)
+            {
+                if (i + step < tree.size() && tree[i + step] <= v)
+                {
+                    i += step;
+                    v -= tree[i];
+                }
+            }
+            return i;
+        }
+    };
+
+    class incremental_index
+    {
+    public:
+        // Blocks are split once they grow past twice this.
+        static const std::size_t block_size = 2048;
+
+    private:
+        struct block
+        {
+            // Offsets are stored less the block's shift.
+            std::vector<incremental_entry> entries;
+            std::uint32_t min_depth;
+        };
+
+        std::vector<block> blocks;
+        fenwick_tree counts;
+        fenwick_tree shifts;
+        std::size_t count;
+        std::size_t max_depth;
+
+        // Parses the element whose name c follows the "<" of, appending an
+        // entry for it and each element within it with depths counted from
+        // depth, and leaves c following the element.
+        static void parse_subtree(
+            const char* doc,
+            const char*& c,
+            std::uint32_t depth,
+            std::size_t max_depth,
+            std::vector<incremental_entry>& entries)
+        {
+            std::vector<std::size_t> open;
+
+            auto finish = [&](std::size_t i)
+            {
+                entries[i].end = static_cast<std::uint64_t>(c - doc);
+                entries[i].subtree_size = static_cast<std::uint32_t>(entries.size() - i);
+            };
+
+            while (true)
+            {
+                std::size_t i = entries.size();
+                incremental_entry e;
+                e.start = static_cast<std::uint64_t>(c - 1 - doc);
+                e.end = 0;
+                e.depth = depth + static_cast<std::uint32_t>(open.size());
+                parse_name_hashed(c, e.name_hash);
+                e.subtree_size = 1;
+                entries.push_back(e);
+
+                parse_attributes(c);
+                if (parse_start_tag_end(c))
+                {
+                    if (e.depth >= max_depth) throw depth_limit_exception(c);
+                    open.push_back(i);
+                }
+                else finish(i);
+
+                while (true)
+                {
+                    if (open.empty()) return;
+                    if (parse_element_text(c)) break;
+
+                    parse<'/'>(c);
+                    parse_name(c);
+                    parse<'>'>(c);
+                    finish(open.back());
+                    open.pop_back();
+                }
+            }
+        }
+
+        static std::uint32_t min_depth_of(const std::vector<incremental_entry>& entries)
+        {
+            std::uint32_t depth = 0xffffffffu;
+            for (const incremental_entry& e : entries) depth = std::min(depth, e.depth);
+            return depth;
+        }
+
+        std::uint64_t shift(std::size_t b) const
+        {
+            return static_cast<std::uint64_t>(shifts.prefix(b));
+        }
+
+        // Block and position within it of entry i.
+        std::pair<std::size_t, std::size_t> locate(std::size_t i) const
+        {
+            std::size_t b = counts.upper_bound(static_cast<std::int64_t>(i));
+            std::size_t first = b == 0 ? 0 : static_cast<std::size_t>(counts.prefix(b - 1));
+            return std::make_pair(b, i - first);
+        }
+
+        // Replaces the blocks with ones holding entries, in chunks of
+        // block_size, whose offsets are stored less the given shifts.
+        void set_blocks(std::vector<std::vector<incremental_entry>>& entries, const std::vector<std::uint64_t>& block_shifts)
+        {
+            blocks.clear();
+            std::vector<std::int64_t> sizes;
+            std::vector<std::int64_t> deltas;
+            std::uint64_t previous = 0;
+            count = 0;
+
+            for (std::size_t i = 0; i < entries.size(); ++i)
+            {
+                std::vector<incremental_entry>& e = entries[i];
+                std::size_t first = 0;
+                while (first < e.size())
+                {
+                    block b;
+                    if (e.size() <= 2 * block_size) b.entries.swap(e);
+                    else b.entries.assign(e.begin() + first, e.begin() + std::min(e.size(), first + block_size));
+                    first += b.entries.size();
+                    b.min_depth = min_depth_of(b.entries);
+
+                    sizes.push_back(static_cast<std::int64_t>(b.entries.size()));
+                    deltas.push_back(static_cast<std::int64_t>(block_shifts[i] - previous));
+                    previous = block_shifts[i];
+                    count += b.entries.size();
+                    blocks.push_back(std::move(b));
+                }
+            }
+
+            counts = fenwick_tree(sizes);
+            shifts = fenwick_tree(deltas);
+        }
+
+        // Calls f(j) for each ancestor j of entry i, innermost first, until
+        // f returns false.
+        template <typename function>
+        void for_each_ancestor(std::size_t i, function f) const
+        {
+            std::pair<std::size_t, std::size_t> at = locate(i);
+            std::size_t b = at.first;
+            std::size_t p = at.second;
+            std::size_t first = i - p;
+            std::uint32_t depth = blocks[b].entries[p].depth;
+
+            while (depth > 0)
+            {
+                const block& bl = blocks[b];
+                if (bl.min_depth < depth)
+                {
+                    while (p-- > 0)
+                    {
+                        if (bl.entries[p].depth < depth)
+                        {
+                            depth = bl.entries[p].depth;
+                            if (!f(first + p)) return;
+                            if (depth == 0) return;
+                        }
+                    }
+                }
+                if (b == 0) return;
+                --b;
+                p = blocks[b].entries.size();
+                first -= p;
+            }
+        }
+
+        // Returns the last entry starting before offset, or size() if
+        // there is none.
+        std::size_t last_starting_before(std::uint64_t offset) const
+        {
+            std::size_t lo = 0;
+            std::size_t hi = blocks.size();
+            while (lo < hi)
+            {
+                std::size_t mid = (lo + hi) / 2;
+                if (blocks[mid].entries.front().start + shift(mid) < offset) lo = mid + 1;
+                else hi = mid;
+            }
+            if (lo == 0) return count;
+
+            std::size_t b = lo - 1;
+            std::uint64_t s = shift(b);
+            const std::vector<incremental_entry>& entries = blocks[b].entries;
+            std::size_t p = static_cast<std::size_t>(std::partition_point(entries.begin(), entries.end(),
+                [=](const incremental_entry& e) { return e.start + s < offset; }) - entries.begin());
+            std::size_t first = b == 0 ? 0 : static_cast<std::size_t>(counts.prefix(b - 1));
+            return first + p - 1;
+        }
+
+        // Returns the innermost of entry i and its ancestors that ends at or
+        // after limit, or size() if there is none.
+        std::size_t enclosing(std::size_t i, std::uint64_t limit) const
+        {
+            if (i == count || (*this)[i].end >= limit) return i;
+            std::size_t result = count;
+            for_each_ancestor(i, [&](std::size_t j)
+            {
+                if ((*this)[j].end < limit) return true;
+                result = j;
+                return false;
+            });
+            return result;
+        }
+
+        // Replaces entries [i, i + old_size) with fresh (with offsets in
+        // the edited document), where the edit moved later offsets by delta.
+        // The entries are within the content of element owner, which is
+        // adjusted along with its ancestors.
+        void splice(
+            std::size_t owner,
+            std::size_t i,
+            std::size_t old_size,
+            std::vector<incremental_entry>& fresh,
+            std::uint64_t delta)
+        {
+            std::int64_t size_change = static_cast<std::int64_t>(fresh.size()) - static_cast<std::int64_t>(old_size);
+            auto adjust = [&](std::size_t j)
+            {
+                std::pair<std::size_t, std::size_t> at = locate(j);
+                incremental_entry& e = blocks[at.first].entries[at.second];
+                e.end += delta;
+                e.subtree_size = static_cast<std::uint32_t>(e.subtree_size + size_change);
+                return true;
+            };
+            if (owner != count)
+            {
+                adjust(owner);
+                for_each_ancestor(owner, adjust);
+            }
+
+            // Blocks and positions of the first entry replaced and the one
+            // following the last, which may be the end of the block.
+            std::pair<std::size_t, std::size_t> first =
+                i < count ? locate(i) : std::make_pair(blocks.size() - 1, blocks.back().entries.size());
+            std::pair<std::size_t, std::size_t> last = first;
+            if (old_size != 0)
+            {
+                last = locate(i + old_size - 1);
+                ++last.second;
+            }
+            std::size_t bi = first.first;
+            std::size_t bl = last.first;
+            std::uint64_t base = shift(bi);
+
+            // The entries from the start of block bi to the end of block bl
+            // with the subtree replaced, stored less the shift of bi.
+            std::vector<incremental_entry> merged;
+            const std::vector<incremental_entry>& head = blocks[bi].entries;
+            const std::vector<incremental_entry>& tail = blocks[bl].entries;
+            merged.reserve(first.second + fresh.size() + tail.size() - last.second);
+            merged.insert(merged.end(), head.begin(), head.begin() + first.second);
+            for (incremental_entry e : fresh)
+            {
+                e.start -= base;
+                e.end -= base;
+                merged.push_back(e);
+            }
+            std::uint64_t moved = shift(bl) - base + delta;
+            for (std::size_t p = last.second; p < tail.size(); ++p)
+            {
+                incremental_entry e = tail[p];
+                e.start += moved;
+                e.end += moved;
+                merged.push_back(e);
+            }
+
+            if (bi == bl && merged.size() <= 2 * block_size)
+            {
+                blocks[bi].entries.swap(merged);
+                blocks[bi].min_depth = min_depth_of(blocks[bi].entries);
+                counts.add(bi, size_change);
+                if (bi + 1 < blocks.size()) shifts.add(bi + 1, static_cast<std::int64_t>(delta));
+                count = static_cast<std::size_t>(static_cast<std::int64_t>(count) + size_change);
+                return;
+            }
+
+            // The number of blocks changes, so the trees are rebuilt, which
+            // takes time linear in the number of blocks.
+            std::vector<std::vector<incremental_entry>> entries;
+            std::vector<std::uint64_t> block_shifts;
+            for (std::size_t b = 0; b < blocks.size(); ++b)
+            {
+                if (b > bi && b <= bl) continue;
+                if (b == bi) entries.push_back(std::move(merged));
+                else entries.push_back(std::move(blocks[b].entries));
+                block_shifts.push_back(shift(b) + (b > bl ? delta : 0));
+            }
+            set_blocks(entries, block_shifts);
+        }
+
+        // Reparses the part of the content of element i from the last child
+        // ending before the edit [offset, edit_end) up to the first child
+        // starting after it, replacing the children in between, and returns
+        // false if that doesn't end where the next child (or the end tag)
+        // has moved to.
+        bool update_content(const char* doc, std::size_t i, std::uint64_t offset, std::uint64_t edit_end, std::uint64_t delta)
+        {
+            incremental_entry e = (*this)[i];
+            std::size_t subtree_end = i + e.subtree_size;
+
+            // Where to start: following the last child that ends before the
+            // edit, at the child the edit starts in, or, if no child starts
+            // before the edit, at the start tag.
+            std::size_t first = last_starting_before(offset);
+            const char* c;
+            bool start_tag = first == i;
+            bool at_child = false;
+            if (start_tag)
+            {
+                first = i + 1;
+                c = doc + e.start + 1;
+            }
+            else
+            {
+                for_each_ancestor(first, [&](std::size_t j)
+                {
+                    if (j == i) return false;
+                    first = j;
+                    return true;
+                });
+                incremental_entry a = (*this)[first];
+                if (a.end <= offset)
+                {
+                    first += a.subtree_size;
+                    c = doc + a.end;
+                }
+                else
+                {
+                    c = doc + a.start + 1;
+                    at_child = true;
+                }
+            }
+
+            // The first child not touched by the edit.
+            std::size_t after = first;
+            while (after < subtree_end && (*this)[after].start < edit_end) after += (*this)[after].subtree_size;
+            bool has_after = after < subtree_end;
+            std::uint64_t target = has_after ? (*this)[after].start + delta : e.end + delta;
+
+            std::vector<incremental_entry> fresh;
+            std::uint32_t name_hash = e.name_hash;
+            try
+            {
+                if (start_tag)
+                {
+                    parse_name_hashed(c, name_hash);
+                    parse_attributes(c);
+                    if (!parse_start_tag_end(c)) return false;
+                }
+
+                bool child = at_child || parse_element_text(c);
+
+                while (child)
+                {
+                    std::uint64_t start = static_cast<std::uint64_t>(c - 1 - doc);
+                    if (has_after && start >= target) break;
+                    parse_subtree(doc, c, e.depth + 1, max_depth, fresh);
+                    child = parse_element_text(c);
+                }
+
+                if (has_after)
+                {
+                    if (!child || static_cast<std::uint64_t>(c - 1 - doc) != target) return false;
+                }
+                else
+                {
+                    if (child) return false;
+                    parse<'/'>(c);
+                    parse_name(c);
+                    parse<'>'>(c);
+                    if (static_cast<std::uint64_t>(c - doc) != target) return false;
+                }
+            }
+            catch (const parsing_exception&)
+            {
+                return false;
+            }
+
+            splice(i, first, after - first, fresh, delta);
+            if (start_tag)
+            {
+                std::pair<std::size_t, std::size_t> at = locate(i);
+                blocks[at.first].entries[at.second].name_hash = name_hash;
+            }
+            return true;
+        }
+
+    public:
+        incremental_index() : count(0), max_depth(default_max_depth) {}
+
+        // Scans the document at doc, which must be NUL-terminated, and
+        // returns its index.
+        static incremental_index build(const char* doc, std::size_t max_depth = default_max_depth)
+        {
+            incremental_index index;
+            index.max_depth = max_depth;
+
+            const char* c = doc;
+            parse_prolog(c);
+
+            std::vector<std::vector<incremental_entry>> entries(1);
+            parse_subtree(doc, c, 0, max_depth, entries[0]);
+            index.set_blocks(entries, std::vector<std::uint64_t>(1, 0));
+            return index;
+        }
+
+        // Brings the index up to date after an edit that replaced
+        // removed_length bytes at offset with inserted_length bytes; doc is
+        // the document after the edit, which must be NUL-terminated.
+        // Returns the element whose subtree (or part of its content) was
+        // reparsed; entries within it may be new, and the others have only
+        // moved, with their ancestors' ends and subtree sizes adjusted.  If
+        // the edited document isn't well-formed, throws parsing_exception
+        // and leaves the index unchanged.
+        std::size_t update(const char* doc, std::uint64_t offset, std::uint64_t removed_length, std::uint64_t inserted_length)
+        {
+            std::uint64_t delta = inserted_length - removed_length;
+            std::uint64_t limit = offset + std::max<std::uint64_t>(removed_length, 1);
+
+            std::size_t i = enclosing(last_starting_before(offset), limit);
+            if (i != count && update_content(doc, i, offset, offset + removed_length, delta)) return i;
+
+            while (i != count)
+            {
+                incremental_entry e = (*this)[i];
+                std::vector<incremental_entry> fresh;
+                const char* c = doc + e.start + 1;
+                bool ok;
+                try
+                {
+                    parse_subtree(doc, c, e.depth, max_depth, fresh);
+                    ok = static_cast<std::uint64_t>(c - doc) == e.end + delta;
+                }
+                catch (const parsing_exception&)
+                {
+                    ok = false;
+                }
+
+                if (ok)
+                {
+                    splice(parent(i), i, e.subtree_size, fresh, delta);
+                    return i;
+                }
+                i = parent(i);
+            }
+
+            *this = build(doc, max_depth);
+            return 0;
+        }
+
+        std::size_t size() const { return count; }
+
+        bool empty() const { return count == 0; }
+
+        incremental_entry operator[](std::size_t i) const
+        {
+            std::pair<std::size_t, std::size_t> at = locate(i);
+            incremental_entry e = blocks[at.first].entries[at.second];
+            std::uint64_t s = shift(at.first);
+            e.start += s;
+            e.end += s;
+            return e;
+        }
+
+        // Navigation by entry number, as in structural_index.  Each returns
+        // size() if there is no such element.
+        std::size_t first_child(std::size_t i) const
+        {
+            return (*this)[i].subtree_size > 1 ? i + 1 : count;
+        }
+
+        std::size_t next_sibling(std::size_t i) const
+        {
+            incremental_entry e = (*this)[i];
+            std::size_t next = i + e.subtree_size;
+            return next < count && (*this)[next].depth == e.depth ? next : count;
+        }
+
+        std::size_t parent(std::size_t i) const
+        {
+            std::size_t result = count;
+            for_each_ancestor(i, [&](std::size_t j)
+            {
+                result = j;
+                return false;
+            });
+            return result;
+        }
+
+        // Returns the innermost element containing the given offset, or
+        // size() if it is outside the root element.
+        std::size_t find(std::uint64_t offset) const
+        {
+            return enclosing(last_starting_before(offset + 1), offset + 1);
+        }
+
+        // parser:: states for an indexed element within doc, the current
+        // version of the document.
+        parser::element<const char*> element(const char* doc, std::size_t i) const
+        {
+            return parser::element<const char*>(doc + (*this)[i].start + 1);
+        }
+
+        parser::content<const char*> following(const char* doc, std::size_t i) const
+        {
+            return parser::content<const char*>(doc + (*this)[i].end);
+        }
+    };
+}
\ No newline at end of file
@@ -0,0 +1,398 @@
+#pragma once
+
+#include "intxml_parser.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// This file implements a structural index of a document: one entry per
+// element, in document order, giving the offsets of the element and of the
+// end of its subtree.  With the index, any element can be reached and any
+// subtree skipped without scanning, and parser:: states can be created
+// directly at the recorded offsets.
+//
+// The index can be saved to a sidecar file and mapped back in later.  The
+// file records the size, modification time and a sampled hash of the source
+// document, and is rejected if any of them has changed.  The entries are
+// stored in the file exactly as they are laid out in memory, so loading is a
+// single mmap.  POSIX only.
+
+namespace intxml
+{
+    const std::uint32_t no_parent = 0xffffffffu;
+
+    // Index entries are 32 bytes.  Since the entries of a subtree are
+    // contiguous, the next sibling of entry i is at i + subtree_size, if it
+    // is at the same depth.
+    struct index_entry
+    {
+        // Offset of the "<" of the start tag.
+        std::uint64_t start;
+
+        // Offset just past the end tag, or the "/>" of an empty element.
+        std::uint64_t end;
+
+        std::uint32_t depth;
+
+        // Hash of the name, as computed by parse_name_hashed.
+        std::uint32_t name_hash;
+
+        // Number of entries in the subtree, including this one.
+        std::uint32_t subtree_size;
+
+        std::uint32_t parent;
+    };
+
+    // What the sidecar file records about the document it was built from.
+    struct source_info
+    {
+        std::uint64_t size;
+        std::int64_t mtime;
+        std::uint64_t hash;
+
+        // Hashes the first and last 64K of the document, which is cheap and
+        // catches most edits that preserve size and modification time.  Since
+        // the hash is sequential, hashing the two samples back to back gives
+        // the same result, which is what read() relies on.
+        static std::uint64_t sample_hash(const char* doc, std::uint64_t size)
+        {
+            const std::uint64_t sample = 1 << 16;
+            std::uint64_t h = 14695981039346656037ull;
+            auto mix = [&h](const char* p, std::uint64_t n)
+            {
+                for (; n > 0; --n, ++p) h = (h ^ static_cast<unsigned char>(*p)) * 1099511628211ull;
+            };
+
+            if (size <= 2 * sample) mix(doc, size);
+            else
+            {
+                mix(doc, sample);
+                mix(doc + size - sample, sample);
+            }
+            return h;
+        }
+
+        // Reads the information from a file.  Returns false if the file
+        // can't be read.
+        bool read(const char* path)
+        {
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0) return false;
+
+            struct stat info;
+            bool ok = ::fstat(fd, &info) == 0;
+            if (ok)
+            {
+                size = static_cast<std::uint64_t>(info.st_size);
+                mtime = static_cast<std::int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+
+                const std::uint64_t sample = 1 << 16;
+                std::vector<char> buffer(static_cast<std::size_t>(std::min(size, 2 * sample)));
+                if (size <= 2 * sample)
+                {
+                    ok = ::pread(fd, buffer.data(), buffer.size(), 0) == static_cast<ssize_t>(buffer.size());
+                }
+                else
+                {
+                    ok = ::pread(fd, buffer.data(), sample, 0) == static_cast<ssize_t>(sample) &&
+                        ::pread(fd, buffer.data() + sample, sample, size - sample) == static_cast<ssize_t>(sample);
+                }
+                hash = sample_hash(buffer.data(), buffer.size());
+            }
+
+            ::close(fd);
+            return ok;
+        }
+
+        bool operator==(const source_info& other) const
+        {
+            return size == other.size && mtime == other.mtime && hash == other.hash;
+        }
+    };
+
+    // Writes a sidecar file consisting of a header followed by count
+    // entries.  The file is written under path + ".tmp", synced and renamed
+    // over path, so a process that has the old file mapped keeps reading
+    // it intact rather than faulting on truncated pages.  Returns false on
+    // failure.
+    inline bool write_sidecar(
+        const char* path,
+        const void* head,
+        std::size_t head_size,
+        const void* entries,
+        std::size_t entry_size,
+        std::size_t count)
+    {
+        std::string temp = std::string(path) + ".tmp";
+        std::FILE* f = std::fopen(temp.c_str(), "wb");
+        if (!f) return false;
+
+        bool ok =
+            std::fwrite(head, head_size, 1, f) == 1 &&
+            std::fwrite(entries, entry_size, count, f) == count &&
+            std::fflush(f) == 0 &&
+            ::fsync(::fileno(f)) == 0;
+        ok = std::fclose(f) == 0 && ok;
+        ok = ok && std::rename(temp.c_str(), path) == 0;
+        if (!ok) std::remove(temp.c_str());
+        return ok;
+    }
+
+    class structural_index
+    {
+        struct header
+        {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t entry_size;
+            source_info source;
+            std::uint64_t count;
+        };
+
+        std::vector<index_entry> owned;
+        const index_entry* data;
+        std::size_t count;
+        void* mapping;
+        std::size_t mapping_size;
+
+        void unmap()
+        {
+            if (mapping) ::munmap(mapping, mapping_size);
+            mapping = nullptr;
+        }
+
+        static void set_magic(header& h)
+        {
+            std::memcpy(h.magic, "IXMLIDX", 8);
+            h.version = 1;
+            h.entry_size = sizeof(index_entry);
+        }
+
+    public:
+        structural_index() : data(nullptr), count(0), mapping(nullptr), mapping_size(0) {}
+
+        structural_index(structural_index&& other) :
+            owned(std::move(other.owned)),
+            data(other.data),
+            count(other.count),
+            mapping(other.mapping),
+            mapping_size(other.mapping_size)
+        {
+            other.data = nullptr;
+            other.count = 0;
+            other.mapping = nullptr;
+        }
+
+        structural_index& operator=(structural_index&& other)
+        {
+            if (this != &other)
+            {
+                unmap();
+                owned = std::move(other.owned);
+                data = other.data;
+                count = other.count;
+                mapping = other.mapping;
+                mapping_size = other.mapping_size;
+                other.data = nullptr;
+                other.count = 0;
+                other.mapping = nullptr;
+            }
+            return *this;
+        }
+
+        structural_index(const structural_index&) = delete;
+        structural_index& operator=(const structural_index&) = delete;
+
+        ~structural_index() { unmap(); }
+
+        // Scans the document at doc, which must be NUL-terminated, and
+        // returns its index.
+        static structural_index build(const char* doc, std::size_t max_depth = default_max_depth)
+        {
+            structural_index index;
+            std::vector<index_entry>& entries = index.owned;
+            std::vector<std::uint32_t> open;
+
+            const char* c = doc;
+            parse_prolog(c);
+
+            auto finish = [&](std::uint32_t i)
+            {
+                entries[i].end = static_cast<std::uint64_t>(c - doc);
+                entries[i].subtree_size = static_cast<std::uint32_t>(entries.size() - i);
+            };
+
+            while (true)
+            {
+                std::uint32_t i = static_cast<std::uint32_t>(entries.size());
+                index_entry e;
+                e.start = static_cast<std::uint64_t>(c - 1 - doc);
+                e.end = 0;
+                e.depth = static_cast<std::uint32_t>(open.size());
+                parse_name_hashed(c, e.name_hash);
+                e.subtree_size = 1;
+                e.parent = open.empty() ? no_parent : open.back();
+                entries.push_back(e);
+
+                parse_attributes(c);
+                if (parse_start_tag_end(c))
+                {
+                    if (open.size() == max_depth) throw depth_limit_exception(c);
+                    open.push_back(i);
+                }
+                else finish(i);
+
+                while (true)
+                {
+                    if (open.empty())
+                    {
+                        index.data = entries.data();
+                        index.count = entries.size();
+                        return index;
+                    }
+                    if (parse_element_text(c)) break;
+
+                    parse<'/'>(c);
+                    parse_name(c);
+                    parse<'>'>(c);
+                    finish(open.back());
+                    open.pop_back();
+                }
+            }
+        }
+
+        // Writes the index to a sidecar file, replacing it atomically.
+        // Returns false on failure.
+        bool save(const char* path, const source_info& source) const
+        {
+            header h;
+            set_magic(h);
+            h.source = source;
+            h.count = count;
+            return write_sidecar(path, &h, sizeof(h), data, sizeof(index_entry), count);
+        }
+
+        // Maps a sidecar file written by save().  Returns false, leaving the
+        // index empty, if the file is missing, malformed or was built from a
+        // different version of the source.
+        bool load(const char* path, const source_info& source)
+        {
+            *this = structural_index();
+
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0) return false;
+
+            struct stat info;
+            void* p = MAP_FAILED;
+            if (::fstat(fd, &info) == 0 && static_cast<std::size_t>(info.st_size) >= sizeof(header))
+            {
+                p = ::mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            }
+            ::close(fd);
+            if (p == MAP_FAILED) return false;
+
+            mapping = p;
+            mapping_size = static_cast<std::size_t>(info.st_size);
+
+            header expected;
+            set_magic(expected);
+            const header& h = *static_cast<const header*>(p);
+            if (std::memcmp(h.magic, expected.magic, sizeof(h.magic)) != 0 ||
+                h.version != expected.version ||
+                h.entry_size != expected.entry_size ||
+                !(h.source == source) ||
+                h.count > (mapping_size - sizeof(header)) / sizeof(index_entry))
+            {
+                unmap();
+                return false;
+            }
+
+            data = reinterpret_cast<const index_entry*>(static_cast<const char*>(p) + sizeof(header));
+            count = static_cast<std::size_t>(h.count);
+            return true;
+        }
+
+        // Loads the sidecar for the document at source_path if it is up to
+        // date, and otherwise builds the index from doc (the contents of
+        // that file) and rewrites the sidecar.
+        static structural_index open_or_build(const char* doc, const char* source_path, const char* index_path)
+        {
+            structural_index index;
+            source_info source;
+            if (!source.read(source_path)) return build(doc);
+            if (index.load(index_path, source)) return index;
+
+            index = build(doc);
+            index.save(index_path, source);
+            return index;
+        }
+
+        std::size_t size() const { return count; }
+
+        bool empty() const { return count == 0; }
+
+        const index_entry& operator[](std::size_t i) const { return data[i]; }
+
+        const index_entry* begin() const { return data; }
+
+        const index_entry* end() const { return data + count; }
+
+        // Navigation by entry number.  Each returns size() if there is no
+        // such element.
+        std::size_t first_child(std::size_t i) const
+        {
+            return data[i].subtree_size > 1 ? i + 1 : count;
+        }
+
+        std::size_t next_sibling(std::size_t i) const
+        {
+            std::size_t next = i + data[i].subtree_size;
+            return next < count && data[next].depth == data[i].depth ? next : count;
+        }
+
+        std::size_t parent(std::size_t i) const
+        {
+            return data[i].parent == no_parent ? count : data[i].parent;
+        }
+
+        // Returns the innermost element containing the given offset, or
+        // size() if it is outside the root element.
+        std::size_t find(std::uint64_t offset) const
+        {
+            const index_entry* e = std::upper_bound(data, data + count, offset,
+                [](std::uint64_t o, const index_entry& x) { return o < x.start; });
+            if (e == data) return count;
+
+            std::size_t i = static_cast<std::size_t>(e - data) - 1;
+            while (data[i].end <= offset)
+            {
+                if (data[i].parent == no_parent) return count;
+                i = data[i].parent;
+            }
+            return i;
+        }
+
+        // parser:: states for an indexed element within doc, the document
+        // the index was built from.
+        parser::element<const char*> element(const char* doc, std::size_t i) const
+        {
+            return parser::element<const char*>(doc + data[i].start + 1);
+        }
+
+        // The content following the element, i.e., the result of skipping
+        // its subtree.
+        parser::content<const char*> following(const char* doc, std::size_t i) const
+        {
+            return parser::content<const char*>(doc + data[i].end);
+        }
+    };
+}
\ No newline at end of file
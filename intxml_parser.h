@@ -1,6 +1,9 @@
 #pragma once
 
 #include "intxml.h"
+#include "intxml_attribute_index.h"
+#include "intxml_skip.h"
+#include "intxml_text.h"
 
 // This file is an attempt to create an interface to a document that is 
 // slightly higher-level than intxml.h.  It defines a series of classes that 
@@ -34,6 +37,8 @@ namespace intxml { namespace parser
     public:
         content(chptr_t ptr) : p(ptr) {}
 
+        const chptr_t& ptr() const { return p; }
+
         // Parses the content up to the next element or close tag and 
         // returns the element (possibly representing the close tag).
         element<chptr_t> sibling()
@@ -51,6 +56,17 @@ namespace intxml { namespace parser
             while (*tp) tp++;
             return element<chptr_t>(tp.ptr());
         }
+
+        // Passes the content up to the next element or close tag to
+        // h(begin, end) in chunks (see intxml_text.h) and returns the
+        // element.
+        template <typename handler>
+        element<chptr_t> text(handler h)
+        {
+            chptr_t pnew(p);
+            parse_text_chunks(pnew, h);
+            return element<chptr_t>(pnew);
+        }
     };
 
     // Just before the value part of an attribute
@@ -62,6 +78,8 @@ namespace intxml { namespace parser
     public:
         attribute_value(chptr_t ptr) : p(ptr) {}
 
+        const chptr_t& ptr() const { return p; }
+
         // Parse the value and return the next attribute (possibly 
         // representing the end of the attribute list).
         attribute<chptr_t> value()
@@ -95,6 +113,8 @@ namespace intxml { namespace parser
 
         attribute(chptr_t ptr) : p(ptr) {}
 
+        const chptr_t& ptr() const { return p; }
+
         // Returns what follows in the document, either an attribute, child 
         // content, or sibling content (if open tag ends with "/>").
         next_types next()
@@ -134,6 +154,14 @@ namespace intxml { namespace parser
             return attribute_value<chptr_t>(pnew);
         }
 
+        // Scans this and the remaining attributes once and returns an index 
+        // for looking them up by name.  Its attributes_end() is where an 
+        // attribute state for the end of the start tag can be created.
+        attribute_index<chptr_t> index()
+        {
+            return attribute_index<chptr_t>(p);
+        }
+
         // Returns an object pointing to the element content.  Throws an 
         // exception if there is no child content (open tag ends with "/>").
         content<chptr_t> child()
@@ -153,6 +181,15 @@ namespace intxml { namespace parser
             parse_element_attribute_end(pnew);
             return content<chptr_t>(pnew);
         }
+
+        // Same as above, for trusted input: the rest of the element is 
+        // skipped without being checked (see intxml_skip.h).
+        content<chptr_t> sibling(trusted_t)
+        {
+            chptr_t pnew(p);
+            skip_element_attribute_end(pnew);
+            return content<chptr_t>(pnew);
+        }
     };
 
     // Just before the name portion in an element open tag, or the '/' in an 
@@ -165,6 +202,8 @@ namespace intxml { namespace parser
     public:
         element(chptr_t ptr) : p(ptr) {}
 
+        const chptr_t& ptr() const { return p; }
+
         enum next_types { element_name, close_tag, end_of_doc };
 
         // Returns true only if there are elements remaining in the content 
@@ -1,9 +1,22 @@
 #pragma once
 
 #include "intxml.h"
+#include "intxml_attribute_index.h"
+#include "intxml_skip.h"
+#include <cstddef>
+#include <memory>
 #include <boost/optional.hpp>
 
 // This file implements a "pull" interface, similar to .NET System.Xml.XmlReader.
+//
+// Element and attribute objects remember the positions they have already
+// parsed (end of the name, end of the start tag, end of the subtree), and
+// the state of an element is shared by all of its copies and kept alive by
+// its children.  Navigating therefore never re-parses a construct that has
+// already been parsed, regardless of the order in which the document is
+// walked.  Since the states hold on to their positions, and children to
+// their parents, the cursor has to have the whole document at hand; the
+// stream_window cursor (intxml_window.h) is not supported.
 
 namespace intxml
 {
@@ -15,98 +28,320 @@ namespace intxml
         }
     };
 
+    template <typename chptr_t> class element;
+    template <typename chptr_t> class attribute;
+
+    // Positions within an element that have been worked out so far.
+    template <typename chptr_t>
+    struct element_state
+    {
+        typedef std::shared_ptr<element_state> ptr;
+
+        // The chain of parents forms the stack of open elements.
+        ptr parent;
+        std::size_t index;
+
+        // Start of the tag name.
+        chptr_t name;
+
+        // After the name and any whitespace, i.e., the first attribute.
+        boost::optional<chptr_t> attributes;
+
+        // The "/>" or ">" ending the start tag.
+        boost::optional<chptr_t> attributes_end;
+
+        // Following the ">" of a start tag, if the element is not empty.
+        boost::optional<chptr_t> content;
+
+        // Following the end tag (or "/>"), i.e., the end of the subtree.
+        boost::optional<chptr_t> end;
+
+        // Furthest position in the content known to be at the element's own
+        // level, and the number of children preceding it.
+        boost::optional<chptr_t> scanned;
+        std::size_t scanned_children;
+
+        std::weak_ptr<element_state> first_child;
+        std::weak_ptr<element_state> next_sibling;
+        bool no_child;
+        bool no_sibling;
+
+        element_state(const ptr& p, std::size_t i, const chptr_t& c) :
+            parent(p), index(i), name(c), scanned_children(0),
+            no_child(false), no_sibling(false)
+        {
+        }
+
+        const chptr_t& attributes_pos()
+        {
+            if (!attributes)
+            {
+                chptr_t c(name);
+                parse_name(c);
+                parse_whitespace(c);
+                attributes = c;
+            }
+            return *attributes;
+        }
+
+        const chptr_t& attributes_end_pos()
+        {
+            if (!attributes_end)
+            {
+                chptr_t c(attributes_pos());
+                parse_attributes(c);
+                attributes_end = c;
+            }
+            return *attributes_end;
+        }
+
+        // Returns true if the start tag ends with ">" rather than "/>".
+        bool has_content()
+        {
+            if (!content && !end)
+            {
+                chptr_t c(attributes_end_pos());
+                if (parse_start_tag_end(c)) content = c;
+                else end = c;
+            }
+            return content.is_initialized();
+        }
+
+        const chptr_t& end_pos()
+        {
+            if (!end && has_content())
+            {
+                chptr_t c(scanned ? *scanned : *content);
+                parse_element_content(c);
+                end = c;
+            }
+            if (parent) parent->child_ended(index, *end);
+            return *end;
+        }
+
+        // Same as above, skipping the rest of the element without checking
+        // it.
+        const chptr_t& end_pos(trusted_t)
+        {
+            if (!end)
+            {
+                if (attributes_end && has_content())
+                {
+                    chptr_t c(scanned ? *scanned : *content);
+                    skip_element_content(c);
+                    end = c;
+                }
+                else if (!attributes_end)
+                {
+                    chptr_t c(attributes ? *attributes : name);
+                    skip_element_attribute_end(c);
+                    end = c;
+                }
+            }
+            if (parent) parent->child_ended(index, *end);
+            return *end;
+        }
+
+        void child_ended(std::size_t i, const chptr_t& c)
+        {
+            if (!end && (!scanned || i + 1 > scanned_children))
+            {
+                scanned = c;
+                scanned_children = i + 1;
+            }
+        }
+
+        // Parses the end tag at c (following the "<") and records the end of
+        // the element.
+        void close(chptr_t c)
+        {
+            parse<'/'>(c);
+            parse_name(c);
+            parse<'>'>(c);
+            end = c;
+        }
+    };
+
     template <typename chptr_t>
     class attribute
     {
+        typedef typename element_state<chptr_t>::ptr state_ptr;
+
+        state_ptr owner;
         chptr_t c;
+        boost::optional<chptr_t> value_pos;
+        boost::optional<chptr_t> next_pos;
+
+        const chptr_t& value_start()
+        {
+            if (!value_pos)
+            {
+                chptr_t cnew(c);
+                parse_attribute_name(cnew);
+                parse_whitespace(cnew);
+                parse<'='>(cnew);
+                parse_whitespace(cnew);
+                value_pos = cnew;
+            }
+            return *value_pos;
+        }
+
+        const chptr_t& next_start()
+        {
+            if (!next_pos)
+            {
+                chptr_t cnew(value_start());
+                intxml::parse_attribute_value(cnew);
+                intxml::parse_whitespace(cnew);
+                if (*cnew == '/' || *cnew == '>') owner->attributes_end = cnew;
+                next_pos = cnew;
+            }
+            return *next_pos;
+        }
+
+        // Skips the remaining attributes, if that hasn't already been done.
+        void finish()
+        {
+            if (!owner->attributes_end)
+            {
+                chptr_t cnew(c);
+                intxml::parse_attributes(cnew);
+                owner->attributes_end = cnew;
+            }
+        }
 
     public:
-        attribute(chptr_t ptr) : c(ptr) {}
+        attribute(const state_ptr& s, const chptr_t& ptr) : owner(s), c(ptr) {}
 
         name_ptr<chptr_t> name() { return name_ptr<chptr_t>(c); }
 
         attribute_value_ptr<chptr_t> value()
         {
-            chptr_t cnew(c);
-            parse_attribute_name(cnew);
-            parse_whitespace(cnew);
-            parse<'='>(cnew);
-            parse_whitespace(cnew);
-            return attribute_value_ptr<chptr_t>(cnew);
+            return attribute_value_ptr<chptr_t>(value_start());
         }
 
         boost::optional<attribute> attrib()
         {
-            chptr_t cnew(c);
-            intxml::parse_attribute(cnew);
-            intxml::parse_whitespace(cnew);
-            if (*cnew != '/' && *cnew != '>') return attribute(cnew);
+            const chptr_t& cnew = next_start();
+            if (*cnew != '/' && *cnew != '>') return attribute(owner, cnew);
             else return boost::none;
         }
 
-        boost::optional<element> child()
+        boost::optional<element<chptr_t>> child()
         {
-            chptr_t cnew(c);
-            if (intxml::parse_start_tag_attribute_end(cnew))
-            {
-                intxml::parse_element_text(cnew);
-                return element(cnew);
-            }
-            else return boost::none;
+            finish();
+            return element<chptr_t>(owner).child();
         }
 
-        boost::optional<element> sibling()
+        boost::optional<element<chptr_t>> sibling()
         {
-            chptr_t cnew(c);
-            intxml::parse_element_attribute_end(cnew);
-            if (intxml::parse_element_text(cnew))
-                return element(cnew);
-            else return boost::none;
+            finish();
+            return element<chptr_t>(owner).sibling();
+        }
+
+        boost::optional<element<chptr_t>> sibling(trusted_t)
+        {
+            return element<chptr_t>(owner).sibling(trusted);
         }
     };
 
     template <typename chptr_t>
     class element
     {
-        chptr_t c;
+        typedef element_state<chptr_t> state_type;
+        typedef typename state_type::ptr state_ptr;
+
+        state_ptr state;
+
+        // Finds the sibling that follows cnew, the end of this element.
+        boost::optional<element> sibling_at(chptr_t cnew)
+        {
+            if (intxml::parse_element_text(cnew))
+            {
+                state_ptr s = std::make_shared<state_type>(
+                    state->parent, state->index + 1, cnew);
+                state->next_sibling = s;
+                return element(s);
+            }
+
+            state->parent->close(cnew);
+            state->no_sibling = true;
+            return boost::none;
+        }
 
     public:
-        element(chptr_t ptr) : c(ptr) {}
+        element(chptr_t ptr) :
+            state(std::make_shared<state_type>(state_ptr(), 0, ptr))
+        {
+        }
 
-        boost::optional<attribute> attrib()
+        element(const state_ptr& s) : state(s) {}
+
+        name_ptr<chptr_t> name() { return name_ptr<chptr_t>(state->name); }
+
+        boost::optional<attribute<chptr_t>> attrib()
         {
-            chptr_t cnew(c);
-            intxml::parse_name(cnew);
-            intxml::parse_whitespace(cnew);
-            if (*cnew != '/' && *cnew != '>') return attribute(cnew);
+            const chptr_t& cnew = state->attributes_pos();
+            if (*cnew != '/' && *cnew != '>') return attribute<chptr_t>(state, cnew);
             else return boost::none;
         }
 
+        // Indexes all of the element's attributes for lookup by name.  This
+        // also records the end of the start tag.
+        attribute_index<chptr_t> attributes()
+        {
+            attribute_index<chptr_t> index(state->attributes_pos());
+            state->attributes_end = index.attributes_end();
+            return index;
+        }
+
         boost::optional<element> child()
         {
-            chptr_t cnew(c);
-            intxml::parse_name(cnew);
-            if (intxml::parse_start_tag_name_end(cnew))
+            if (state_ptr s = state->first_child.lock()) return element(s);
+            if (state->no_child) return boost::none;
+
+            if (state->has_content())
             {
-                intxml::parse_element_text(cnew);
-                return element(cnew);
+                chptr_t cnew(*state->content);
+                if (intxml::parse_element_text(cnew))
+                {
+                    state_ptr s = std::make_shared<state_type>(state, 0, cnew);
+                    state->first_child = s;
+                    return element(s);
+                }
+                state->close(cnew);
             }
-            else return boost::none;
+
+            state->no_child = true;
+            return boost::none;
         }
 
         boost::optional<element> sibling()
         {
-            chptr_t cnew(c);
-            intxml::parse_element_name_end(cnew);
-            if (intxml::parse_element_text(cnew))
-                return element(cnew);
-            else return boost::none;
+            if (!state->parent) return boost::none;
+            if (state_ptr s = state->next_sibling.lock()) return element(s);
+            if (state->no_sibling) return boost::none;
+            return sibling_at(state->end_pos());
+        }
+
+        // Same as above, for trusted input: the rest of this element is 
+        // skipped without being checked (see intxml_skip.h).
+        boost::optional<element> sibling(trusted_t)
+        {
+            if (!state->parent) return boost::none;
+            if (state_ptr s = state->next_sibling.lock()) return element(s);
+            if (state->no_sibling) return boost::none;
+            return sibling_at(state->end_pos(trusted));
         }
 
+        // Returns the sibling of the parent element.  Only the remainder of
+        // the parent's content is parsed, continuing from the furthest point
+        // already reached.
         boost::optional<element> uncle()
         {
-            chptr_t cnew(c);
-            // TODO
+            if (!state->parent) return boost::none;
+            state->end_pos();
+            return element(state->parent).sibling();
         }
     };
 
@@ -122,8 +357,9 @@ namespace intxml
 
         element<chptr_t> root()
         {
-            intxml::parse_prolog(c);
-            return element(c);
+            chptr_t cnew(c);
+            intxml::parse_prolog(cnew);
+            return element<chptr_t>(cnew);
         }
     };
 
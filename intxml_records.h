@@ -0,0 +1,365 @@
+#pragma once
+
+#include "intxml_parser.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// This file implements parallel processing of documents made of a root
+// element wrapping a long list of independent records.  A splitter walks the
+// children of the root with the parser:: states, which skip each record's
+// subtree without looking into it, and pushes the [start, end) spans of the
+// records in batches through a bounded lock-free queue to a pool of worker
+// threads.  The spans point into the document, so nothing is copied, and a
+// full queue stalls the splitter until the workers catch up.  Threads that
+// find nothing to do sleep on a condition variable rather than spin, which
+// only costs a lock when some thread is actually asleep.
+
+namespace intxml
+{
+    // Bounded multi-producer/multi-consumer queue (Vyukov's algorithm).  The
+    // capacity is rounded up to a power of two.
+    template <typename t>
+    class mpmc_queue
+    {
+        struct cell
+        {
+            std::atomic<std::size_t> sequence;
+            t value;
+        };
+
+        std::unique_ptr<cell[]> cells;
+        std::size_t mask;
+        alignas(64) std::atomic<std::size_t> head;
+        alignas(64) std::atomic<std::size_t> tail;
+
+    public:
+        explicit mpmc_queue(std::size_t capacity) : head(0), tail(0)
+        {
+            std::size_t size = 2;
+            while (size < capacity) size *= 2;
+            cells.reset(new cell[size]);
+            mask = size - 1;
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        mpmc_queue(const mpmc_queue&) = delete;
+        mpmc_queue& operator=(const mpmc_queue&) = delete;
+
+        // Returns false if the queue is full.
+        bool try_push(const t& value)
+        {
+            std::size_t pos = tail.load(std::memory_order_relaxed);
+            while (true)
+            {
+                cell& c = cells[pos & mask];
+                std::size_t seq = c.sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq - pos);
+                if (diff == 0)
+                {
+                    if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        c.value = value;
+                        c.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0) return false;
+                else pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Returns false if the queue is empty.
+        bool try_pop(t& value)
+        {
+            std::size_t pos = head.load(std::memory_order_relaxed);
+            while (true)
+            {
+                cell& c = cells[pos & mask];
+                std::size_t seq = c.sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+                if (diff == 0)
+                {
+                    if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        value = c.value;
+                        c.sequence.store(pos + mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0) return false;
+                else pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    };
+
+    // Lets threads sleep until an operation on a lock-free queue may
+    // succeed.  Notifying only takes the lock when a thread is waiting; the
+    // fences on both sides ensure that either the waiter sees the change or
+    // the notifier sees the waiter.
+    class queue_waiter
+    {
+        std::mutex lock;
+        std::condition_variable changed;
+        std::atomic<std::size_t> waiting;
+
+        bool any_waiting()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return waiting.load(std::memory_order_relaxed) != 0;
+        }
+
+    public:
+        queue_waiter() : waiting(0) {}
+
+        queue_waiter(const queue_waiter&) = delete;
+        queue_waiter& operator=(const queue_waiter&) = delete;
+
+        // Blocks until ready() returns true.
+        template <typename predicate>
+        void wait(predicate ready)
+        {
+            if (ready()) return;
+
+            std::unique_lock<std::mutex> guard(lock);
+            waiting.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            changed.wait(guard, ready);
+            waiting.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        void notify_one()
+        {
+            if (!any_waiting()) return;
+            std::lock_guard<std::mutex> guard(lock);
+            changed.notify_one();
+        }
+
+        void notify_all()
+        {
+            if (!any_waiting()) return;
+            std::lock_guard<std::mutex> guard(lock);
+            changed.notify_all();
+        }
+    };
+
+    // A complete element within the document, from its "<" to just past its
+    // end tag (or "/>").
+    struct record_span
+    {
+        const char* begin;
+        const char* end;
+    };
+
+    // Records in document order.  Batches are numbered consecutively, which
+    // lets consumers restore document order if they need to.
+    struct record_batch
+    {
+        std::size_t sequence;
+        std::vector<record_span> records;
+    };
+
+    // Finds the spans of the children of the root element.  If a name is
+    // given, children with other names are skipped.
+    class record_splitter
+    {
+        parser::content<const char*> content;
+        const char* name;
+        std::size_t name_length;
+        bool done;
+
+        bool matches(const char* p) const
+        {
+            if (!name) return true;
+            if (std::strncmp(p, name, name_length) != 0) return false;
+
+            char next = p[name_length];
+            return std::isspace(static_cast<unsigned char>(next)) || next == '/' || next == '>';
+        }
+
+    public:
+        record_splitter(const char* doc, const char* record_name = nullptr) :
+            content(nullptr),
+            name(record_name),
+            name_length(record_name ? std::strlen(record_name) : 0),
+            done(false)
+        {
+            const char* p = parser::document<const char*>(doc).root().name().ptr();
+            parse_attributes(p);
+            if (parse_start_tag_end(p)) content = parser::content<const char*>(p);
+            else done = true;
+        }
+
+        // Returns false once the end tag of the root element is reached.
+        bool next(record_span& record)
+        {
+            while (!done)
+            {
+                parser::element<const char*> e = content.sibling();
+                if (e.next() != parser::element<const char*>::element_name)
+                {
+                    done = true;
+                    break;
+                }
+
+                record.begin = e.ptr() - 1;
+                content = e.name().sibling();
+                record.end = content.ptr();
+                if (matches(e.ptr())) return true;
+            }
+            return false;
+        }
+    };
+
+    struct record_options
+    {
+        // Worker threads; 0 uses the hardware concurrency.
+        std::size_t threads;
+        std::size_t batch_size;
+        std::size_t queue_capacity;
+        const char* record_name;
+
+        record_options() :
+            threads(0), batch_size(256), queue_capacity(64), record_name(nullptr)
+        {
+        }
+    };
+
+    // Splits the document on the calling thread and calls h(const
+    // record_batch&) for each batch on the worker threads.  Batches are
+    // recycled once the handler returns, so the spans must not be retained
+    // beyond it.  The first exception thrown by the splitter or a handler is
+    // rethrown after all threads have stopped.
+    template <typename handler>
+    void process_record_batches(const char* doc, handler h, const record_options& options = record_options())
+    {
+        std::size_t threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+
+        // Every batch is either being filled, queued, being processed or
+        // free, so this many batches never run short.
+        std::size_t batch_count = options.queue_capacity + threads + 1;
+        std::vector<record_batch> batches(batch_count);
+        mpmc_queue<record_batch*> full(options.queue_capacity);
+        mpmc_queue<record_batch*> spare(batch_count);
+        for (record_batch& b : batches)
+        {
+            b.records.reserve(options.batch_size);
+            spare.try_push(&b);
+        }
+
+        std::atomic<bool> finished(false);
+        std::atomic<bool> failed(false);
+        std::exception_ptr error;
+        std::atomic_flag error_lock = ATOMIC_FLAG_INIT;
+
+        // Workers wait for batches, and the splitter waits for spare batches
+        // or room in the queue.
+        queue_waiter work_ready;
+        queue_waiter room_ready;
+
+        auto fail = [&]()
+        {
+            if (!error_lock.test_and_set()) error = std::current_exception();
+            failed.store(true);
+            room_ready.notify_all();
+        };
+
+        auto work = [&]()
+        {
+            record_batch* b = nullptr;
+            while (true)
+            {
+                // The splitter has pushed everything by the time it sets
+                // finished, so an empty pop after seeing it means the work is
+                // done.
+                bool last = false;
+                work_ready.wait([&]
+                {
+                    last = finished.load(std::memory_order_acquire);
+                    return full.try_pop(b) || last;
+                });
+
+                if (b)
+                {
+                    if (!failed.load(std::memory_order_relaxed))
+                    {
+                        try
+                        {
+                            h(static_cast<const record_batch&>(*b));
+                        }
+                        catch (...)
+                        {
+                            fail();
+                        }
+                    }
+                    b->records.clear();
+                    spare.try_push(b);
+                    b = nullptr;
+                    room_ready.notify_one();
+                }
+                else if (last) break;
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (std::size_t i = 0; i < threads; ++i) workers.emplace_back(work);
+
+        try
+        {
+            record_splitter splitter(doc, options.record_name);
+            std::size_t sequence = 0;
+            record_batch* b = nullptr;
+            record_span r;
+            bool more = true;
+
+            while (more && !failed.load(std::memory_order_relaxed))
+            {
+                if (!b) room_ready.wait([&] { return spare.try_pop(b); });
+
+                more = splitter.next(r);
+                if (more) b->records.push_back(r);
+
+                if (b->records.size() == options.batch_size || (!more && !b->records.empty()))
+                {
+                    b->sequence = sequence++;
+                    room_ready.wait([&]
+                    {
+                        return full.try_push(b) || failed.load(std::memory_order_relaxed);
+                    });
+                    work_ready.notify_one();
+                    b = nullptr;
+                }
+            }
+        }
+        catch (...)
+        {
+            fail();
+        }
+
+        finished.store(true, std::memory_order_release);
+        work_ready.notify_all();
+        for (std::thread& t : workers) t.join();
+
+        if (error) std::rethrow_exception(error);
+    }
+
+    // Same as above, calling h(const record_span&) for each record.
+    template <typename handler>
+    void process_records(const char* doc, handler h, const record_options& options = record_options())
+    {
+        process_record_batches(doc, [&h](const record_batch& b)
+        {
+            for (const record_span& r : b.records) h(r);
+        }, options);
+    }
+}
\ No newline at end of file
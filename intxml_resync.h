@@ -0,0 +1,266 @@
+#pragma once
+
+#include "intxml_index.h"
+#include "intxml_parser.h"
+#include "intxml_skip.h"
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// This file implements starting to parse a document at an arbitrary byte
+// offset, e.g., to sample a huge file or split it for parallel processing
+// without reading everything before the offset.
+//
+// Since "<" can't appear in attribute values, a "<" followed by a name
+// character is a start tag unless it is inside a comment, CDATA section or
+// processing instruction.  resync() finds the first such "<" at or after
+// the offset and rejects it if
+//
+//  - the nearest opening "<!--", "<![CDATA[" or "<?" within look_back bytes
+//    before it has no matching terminator in between, or
+//  - the first terminator within look_ahead bytes after it comes before any
+//    opening sequence, or
+//  - parsing forward from it with the regular (checking) routines fails
+//    within verify_tags tags.
+//
+// These are heuristics: a comment or CDATA section longer than both
+// windows, containing markup that parses, can still fool them.  When a
+// structural_index of the document is available, the overload taking it is
+// exact and doesn't scan at all.
+//
+// The depth of the element found is reconstructed by scanning the rest of
+// the document with the trusted skipper (see intxml_skip.h) and counting the
+// end tags that close elements opened before it.  That reads the suffix
+// rather than the prefix, so it is only done when asked for.
+
+namespace intxml
+{
+    // Reported as the depth of a resync_point when it wasn't reconstructed.
+    const std::size_t unknown_depth = std::size_t(-1);
+
+    struct resync_options
+    {
+        std::size_t look_back;
+        std::size_t look_ahead;
+        std::size_t verify_tags;
+
+        // Whether to reconstruct the depth; otherwise it is reported as
+        // unknown_depth.
+        // This scans from the element to the end of the document, so it
+        // costs as much as reading the whole suffix and is off by default;
+        // splitting a file into n parts with it reads about n/2 times the
+        // file.
+        bool find_depth;
+
+        resync_options() : look_back(4096), look_ahead(4096), verify_tags(8), find_depth(false) {}
+    };
+
+    struct resync_point
+    {
+        // Offset of the "<" of the start tag.
+        std::uint64_t offset;
+
+        // Number of elements enclosing the element; 0 for the root.  The
+        // scanning overload reports unknown_depth unless
+        // resync_options::find_depth is set.
+        std::size_t depth;
+
+        // The element's state, following the "<".
+        parser::element<const char*> element;
+
+        resync_point() : offset(0), depth(unknown_depth), element(nullptr) {}
+    };
+
+    // Returns the depth of the start tag at p (its "<"), i.e., the number of
+    // end tags that follow it without a matching start tag.
+    inline std::size_t depth_at(const char* p)
+    {
+        std::size_t depth = 0;
+        const char* c = p;
+        while (true)
+        {
+            skip_to<'<'>(c);
+            if (is_null(c)) return depth;
+            ++c;
+
+            switch (*c)
+            {
+            case '/':
+                skip_to<'>'>(c);
+                if (is_null(c)) return depth;
+                ++c;
+                ++depth;
+                break;
+            case '!':
+                ++c;
+                if (*c == '-') skip_past_terminator<'-', 2>(c);
+                else skip_past_terminator<']', 2>(c);
+                break;
+            case '?':
+                skip_past_terminator<'?', 1>(c);
+                break;
+            default:
+                skip_element_name_end(c);
+                break;
+            }
+        }
+    }
+
+    // Constructs that may contain "<" followed by a name character.
+    struct delimited_section
+    {
+        const char* open;
+        std::size_t open_length;
+        const char* close;
+        std::size_t close_length;
+    };
+
+    const std::size_t delimited_section_count = 3;
+
+    inline const delimited_section* delimited_sections()
+    {
+        static const delimited_section table[delimited_section_count] =
+        {
+            { "<!--", 4, "-->", 3 },
+            { "<![CDATA[", 9, "]]>", 3 },
+            { "<?", 2, "?>", 2 }
+        };
+        return table;
+    }
+
+    // If the candidate start tag at p looks to be inside a comment, CDATA
+    // section or PI, returns the position following its terminator;
+    // otherwise returns null.
+    inline const char* enclosing_section_end(
+        const char* doc, const char* end, const char* p, const resync_options& o)
+    {
+        auto find = [](const char* begin, const char* last, const char* s, std::size_t n) -> const char*
+        {
+            const char* found = std::search(begin, last, s, s + n);
+            return found == last ? nullptr : found;
+        };
+
+        const char* back = p - std::min<std::size_t>(o.look_back, static_cast<std::size_t>(p - doc));
+        const char* ahead = p + std::min<std::size_t>(o.look_ahead, static_cast<std::size_t>(end - p));
+
+        for (std::size_t i = 0; i < delimited_section_count; ++i)
+        {
+            const delimited_section& s = delimited_sections()[i];
+
+            // An opening sequence behind with no terminator since...
+            const char* open = std::find_end(back, p, s.open, s.open + s.open_length);
+            bool inside = open != p && !find(open + s.open_length, p, s.close, s.close_length);
+
+            // ...or a terminator ahead with no opening sequence before it.
+            const char* close = find(p, ahead, s.close, s.close_length);
+            if (close && !inside) inside = !find(p, close, s.open, s.open_length);
+
+            if (inside)
+            {
+                close = find(p, end, s.close, s.close_length);
+                return close ? close + s.close_length : end;
+            }
+        }
+        return nullptr;
+    }
+
+    // Parses forward from the start tag following c for up to count tags,
+    // returning false if that fails.
+    inline bool verify_start_tag(const char* c, std::size_t count)
+    {
+        try
+        {
+            parse_name(c);
+            parse_attributes(c);
+            parse_start_tag_end(c);
+
+            for (std::size_t i = 1; i < count && !is_null(c); ++i)
+            {
+                if (parse_element_text(c))
+                {
+                    parse_name(c);
+                    parse_attributes(c);
+                    parse_start_tag_end(c);
+                }
+                else
+                {
+                    parse<'/'>(c);
+                    parse_name(c);
+                    parse<'>'>(c);
+                    parse_whitespace(c);
+                }
+            }
+            return true;
+        }
+        catch (const parsing_exception&)
+        {
+            // Running into the end of the document is fine; the candidate
+            // may just be one of the last few tags.
+            return is_null(c);
+        }
+    }
+
+    // Finds the first start tag at or after offset in the document at doc,
+    // which must be NUL-terminated, with size the position of the NUL.
+    // Returns false if there is none.
+    inline bool resync(
+        const char* doc,
+        std::size_t size,
+        std::uint64_t offset,
+        resync_point& result,
+        const resync_options& o = resync_options())
+    {
+        const char* end = doc + size;
+        const char* p = doc + std::min<std::uint64_t>(offset, size);
+
+        while (true)
+        {
+            p = static_cast<const char*>(std::memchr(p, '<', static_cast<std::size_t>(end - p)));
+            if (!p) return false;
+
+            char next = p[1];
+            if (!std::isalpha(static_cast<unsigned char>(next)) && next != '_')
+            {
+                ++p;
+                continue;
+            }
+
+            if (const char* skip = enclosing_section_end(doc, end, p, o))
+            {
+                p = skip;
+                continue;
+            }
+
+            if (!verify_start_tag(p + 1, o.verify_tags))
+            {
+                ++p;
+                continue;
+            }
+
+            result.offset = static_cast<std::uint64_t>(p - doc);
+            result.depth = o.find_depth ? depth_at(p) : unknown_depth;
+            result.element = parser::element<const char*>(p + 1);
+            return true;
+        }
+    }
+
+    // Same as above, using the structural index of the document to find the
+    // element and its depth exactly.
+    inline bool resync(
+        const char* doc,
+        const structural_index& index,
+        std::uint64_t offset,
+        resync_point& result)
+    {
+        const index_entry* e = std::lower_bound(index.begin(), index.end(), offset,
+            [](const index_entry& x, std::uint64_t o) { return x.start < o; });
+        if (e == index.end()) return false;
+
+        result.offset = e->start;
+        result.depth = e->depth;
+        result.element = parser::element<const char*>(doc + e->start + 1);
+        return true;
+    }
+}
\ No newline at end of file
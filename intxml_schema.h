@@ -0,0 +1,468 @@
+#pragma once
+
+#include "intxml_parser.h"
+#include <cstddef>
+#include <vector>
+
+// This file implements parsers specialized at compile time for a fixed
+// document structure.  The structure is described with the types below, for
+// example
+//
+//     using namespace intxml::schema;
+//
+//     typedef element<name<'i','d'>, attributes<>, text> id;
+//     typedef element<
+//         name<'r','e','c'>,
+//         attributes<attribute<name<'k','e','y'>>>,
+//         sequence<id>> record;
+//     typedef element<name<'r','o','o','t'>, attributes<>, repeat<record>> root;
+//
+// Tag and attribute names are matched as literals (several bytes per compare
+// with padded_ptr), and the constructs that the schema rules out are never
+// looked for: CDATA sections, entity references, unexpected elements or
+// attributes, and comments and processing instructions other than between
+// the children of a repeat all simply fail the match.  Input that does not
+// match is handed to a caller-supplied fallback built on the generic
+// parser:: states.
+//
+// Values are reported to a handler:
+//
+//     h(element_t(), attribute_t(), begin, end)   for attribute values
+//     h(element_t(), begin, end)                  for text content
+//
+// where begin and end are cursors delimiting the raw characters.  Values are
+// recorded during the match and only passed on once the whole element has
+// matched, so the handler never sees part of an element that goes to the
+// fallback.
+//
+// Within the outermost repeat, e.g., the records of a document, a child that
+// doesn't match is skipped, and passed to the fallback by itself when the
+// recorded values are passed on, in document order with them.  Comments and
+// processing instructions between the children are skipped.  If the element
+// as a whole doesn't match, e.g., because of text between the children, it
+// goes to the fallback instead and nothing is reported for its children.
+// Since the values are held until the end of the element, the memory used
+// grows with the number of values in it.
+
+namespace intxml { namespace schema
+{
+    template <char... chs> struct name {};
+
+    template <typename name_t> struct attribute {};
+
+    // The attributes of an element, in the order they must appear.  No other
+    // attributes are allowed.
+    template <typename... attribute_ts> struct attributes {};
+
+    // Content models: no content, text only, the listed elements once each in
+    // order, or any number of the same element.  Whitespace may appear
+    // between child elements.
+    struct empty {};
+    struct text {};
+    template <typename... element_ts> struct sequence {};
+    template <typename element_t> struct repeat {};
+
+    template <
+        typename name_t,
+        typename attributes_t = attributes<>,
+        typename content_t = empty>
+    struct element {};
+
+    template <typename chptr_t>
+    bool at_name_end(chptr_t& c)
+    {
+        unsigned char ch = static_cast<unsigned char>(*c);
+        return
+            !std::isalpha(ch) &&
+            !std::isdigit(ch) &&
+            *c != '.' &&
+            *c != '-' &&
+            *c != '_' &&
+            *c != ':';
+    }
+
+    // What a match is reported to: records the handler calls, and the
+    // children of a repeat that go to the fallback, so that they can be
+    // passed on in order once the match succeeds or dropped if it fails.
+    template <typename chptr_t, typename handler, typename fallback_t>
+    class match_context
+    {
+        struct event
+        {
+            void (*emit)(match_context&, const chptr_t&, const chptr_t&);
+            chptr_t begin;
+            chptr_t end;
+        };
+
+        template <typename element_t, typename attribute_t>
+        static void emit_attribute(match_context& x, const chptr_t& begin, const chptr_t& end)
+        {
+            x.h(element_t(), attribute_t(), begin, end);
+        }
+
+        template <typename element_t>
+        static void emit_text(match_context& x, const chptr_t& begin, const chptr_t& end)
+        {
+            x.h(element_t(), begin, end);
+        }
+
+        // begin follows the "<" of the element.
+        static void emit_fallback(match_context& x, const chptr_t& begin, const chptr_t&)
+        {
+            (*x.fallback)(parser::element<chptr_t>(begin));
+        }
+
+        handler& h;
+        fallback_t* fallback;
+        std::vector<event> events;
+        std::size_t repeat_depth;
+
+    public:
+        match_context(handler& h, fallback_t* fallback) :
+            h(h), fallback(fallback), repeat_depth(0)
+        {
+        }
+
+        template <typename element_t, typename attribute_t>
+        void operator()(element_t, attribute_t, const chptr_t& begin, const chptr_t& end)
+        {
+            event e = { &emit_attribute<element_t, attribute_t>, begin, end };
+            events.push_back(e);
+        }
+
+        template <typename element_t>
+        void operator()(element_t, const chptr_t& begin, const chptr_t& end)
+        {
+            event e = { &emit_text<element_t>, begin, end };
+            events.push_back(e);
+        }
+
+        std::size_t mark() const { return events.size(); }
+
+        void rollback(std::size_t m)
+        {
+            events.erase(events.begin() + static_cast<std::ptrdiff_t>(m), events.end());
+        }
+
+        // Records that the element following the "<" at c goes to the
+        // fallback.
+        void fall_back(const chptr_t& c)
+        {
+            event e = { &emit_fallback, c, c };
+            events.push_back(e);
+        }
+
+        // Passes the recorded calls on to the handler and the fallback.
+        void commit()
+        {
+            for (const event& e : events) e.emit(*this, e.begin, e.end);
+            events.clear();
+        }
+
+        // Whether the children of a repeat entered now may go to the fallback
+        // one by one, i.e., whether there is a fallback and no enclosing
+        // repeat.
+        bool enter_repeat()
+        {
+            return fallback != nullptr && repeat_depth++ == 0;
+        }
+
+        void leave_repeat()
+        {
+            if (fallback) --repeat_depth;
+        }
+    };
+
+    // Stands in for the fallback where there is none.
+    struct no_fallback
+    {
+        template <typename chptr_t>
+        parser::content<chptr_t> operator()(parser::element<chptr_t> e) const
+        {
+            return parser::content<chptr_t>(e.ptr());
+        }
+    };
+
+    template <typename t> struct matcher;
+
+    template <char... chs>
+    struct matcher<name<chs...>>
+    {
+        template <typename chptr_t>
+        static bool match(chptr_t& c)
+        {
+            return match_literal<chs...>(c) && at_name_end(c);
+        }
+    };
+
+    template <typename element_t, typename... attribute_ts> struct attribute_list;
+
+    template <typename element_t>
+    struct attribute_list<element_t>
+    {
+        template <typename chptr_t, typename handler>
+        static bool match(chptr_t&, handler&)
+        {
+            return true;
+        }
+    };
+
+    template <typename element_t, typename name_t, typename... rest>
+    struct attribute_list<element_t, attribute<name_t>, rest...>
+    {
+        template <typename chptr_t, typename handler>
+        static bool match(chptr_t& c, handler& h)
+        {
+            if (!std::isspace(static_cast<unsigned char>(*c))) return false;
+            parse_whitespace(c);
+            if (!matcher<name_t>::match(c)) return false;
+            parse_whitespace(c);
+            if (*c != '=') return false;
+            ++c;
+            parse_whitespace(c);
+
+            char quote = *c;
+            if (quote != '"' && quote != '\'') return false;
+            ++c;
+
+            chptr_t begin(c);
+            while (*c != quote)
+            {
+                if (*c == '&' || *c == '<' || *c == 0) return false;
+                ++c;
+            }
+            h(element_t(), attribute<name_t>(), begin, c);
+            ++c;
+
+            return attribute_list<element_t, rest...>::match(c, h);
+        }
+    };
+
+    // Content matchers start following the ">" of the start tag and stop at
+    // the "<" of the end tag.  match_empty() is used for "/>".
+    template <typename element_t, typename content_t> struct content_matcher;
+
+    template <typename element_t>
+    struct content_matcher<element_t, empty>
+    {
+        template <typename chptr_t, typename handler>
+        static bool match(chptr_t& c, handler&)
+        {
+            parse_whitespace(c);
+            return true;
+        }
+
+        template <typename chptr_t, typename handler>
+        static bool match_empty(chptr_t&, handler&)
+        {
+            return true;
+        }
+    };
+
+    template <typename element_t>
+    struct content_matcher<element_t, text>
+    {
+        template <typename chptr_t, typename handler>
+        static bool match(chptr_t& c, handler& h)
+        {
+            chptr_t begin(c);
+            while (*c != '<')
+            {
+                if (*c == '&' || *c == '>' || *c == 0) return false;
+                ++c;
+            }
+            h(element_t(), begin, c);
+            return true;
+        }
+
+        template <typename chptr_t, typename handler>
+        static bool match_empty(chptr_t& c, handler& h)
+        {
+            h(element_t(), c, c);
+            return true;
+        }
+    };
+
+    template <typename element_t>
+    struct content_matcher<element_t, sequence<>>
+    {
+        template <typename chptr_t, typename handler>
+        static bool match(chptr_t& c, handler&)
+        {
+            parse_whitespace(c);
+            return true;
+        }
+
+        template <typename chptr_t, typename handler>
+        static bool match_empty(chptr_t&, handler&)
+        {
+            return true;
+        }
+    };
+
+    template <typename element_t, typename first, typename... rest>
+    struct content_matcher<element_t, sequence<first, rest...>>
+    {
+        template <typename chptr_t, typename handler>
+        static bool match(chptr_t& c, handler& h)
+        {
+            parse_whitespace(c);
+            if (*c != '<') return false;
+            ++c;
+            if (!matcher<first>::match(c, h)) return false;
+            return content_matcher<element_t, sequence<rest...>>::match(c, h);
+        }
+
+        template <typename chptr_t, typename handler>
+        static bool match_empty(chptr_t&, handler&)
+        {
+            return false;
+        }
+    };
+
+    template <typename element_t, typename child_t>
+    struct content_matcher<element_t, repeat<child_t>>
+    {
+        template <typename chptr_t, typename context>
+        static bool match(chptr_t& c, context& x)
+        {
+            bool split = x.enter_repeat();
+            bool result = match_children(c, x, split);
+            x.leave_repeat();
+            return result;
+        }
+
+        template <typename chptr_t, typename context>
+        static bool match_children(chptr_t& c, context& x, bool split)
+        {
+            while (true)
+            {
+                parse_whitespace(c);
+                if (*c != '<') return false;
+
+                chptr_t p(c);
+                ++p;
+                if (*p == '/') return true;
+
+                if (match_literal<'!', '-', '-'>(p))
+                {
+                    parse_comment_content_end(p);
+                    c = p;
+                    continue;
+                }
+                if (*p == '?')
+                {
+                    ++p;
+                    parse_pi_content_end(p);
+                    c = p;
+                    continue;
+                }
+
+                if (!split)
+                {
+                    if (!matcher<child_t>::match(p, x)) return false;
+                    c = p;
+                    continue;
+                }
+
+                // A child that doesn't match is skipped here, and parsed by
+                // the fallback if the whole element matches.  If it can't
+                // even be skipped, the whole element goes to the fallback,
+                // which reports the error.
+                std::size_t m = x.mark();
+                if (matcher<child_t>::match(p, x)) c = p;
+                else
+                {
+                    x.rollback(m);
+                    ++c;
+                    x.fall_back(c);
+                    try
+                    {
+                        parse_element_name_end(c);
+                    }
+                    catch (const parsing_exception&)
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+
+        template <typename chptr_t, typename handler>
+        static bool match_empty(chptr_t&, handler&)
+        {
+            return true;
+        }
+    };
+
+    // Matches an element starting at its name, i.e., following the "<", and
+    // on success leaves c following its end tag.
+    template <char... chs, typename... attribute_ts, typename content_t>
+    struct matcher<element<name<chs...>, attributes<attribute_ts...>, content_t>>
+    {
+        typedef element<name<chs...>, attributes<attribute_ts...>, content_t> element_t;
+        typedef content_matcher<element_t, content_t> content_type;
+
+        template <typename chptr_t, typename handler>
+        static bool match(chptr_t& c, handler& h)
+        {
+            if (!matcher<name<chs...>>::match(c)) return false;
+            if (!attribute_list<element_t, attribute_ts...>::match(c, h)) return false;
+            parse_whitespace(c);
+
+            if (*c == '/')
+            {
+                ++c;
+                if (*c != '>') return false;
+                ++c;
+                return content_type::match_empty(c, h);
+            }
+
+            if (*c != '>') return false;
+            ++c;
+            if (!content_type::match(c, h)) return false;
+
+            // The whole end tag up to the name is a single literal.
+            if (!match_literal<'<', '/', chs...>(c)) return false;
+            parse_whitespace(c);
+            if (*c != '>') return false;
+            ++c;
+            return true;
+        }
+    };
+
+    // Matches the element whose name c points to against schema_t.  Returns
+    // true and leaves c following the element if it matches, and otherwise
+    // returns false and leaves c unchanged, without calling h.  Since there
+    // is no fallback, a child of a repeat that doesn't match fails the whole
+    // match.
+    template <typename schema_t, typename chptr_t, typename handler>
+    bool match(chptr_t& c, handler& h)
+    {
+        match_context<chptr_t, handler, no_fallback> x(h, nullptr);
+        chptr_t p(c);
+        if (!matcher<schema_t>::match(p, x)) return false;
+        x.commit();
+        c = p;
+        return true;
+    }
+
+    // Parses the element e with the parser specialized for schema_t, or, if
+    // it doesn't match, returns fallback(e).  Either way the result is the
+    // content following the element.  fallback is also called for children
+    // of the outermost repeat that don't match (see above), so it must
+    // handle any element; its result is ignored in that case.
+    template <typename schema_t, typename chptr_t, typename handler, typename fallback_t>
+    parser::content<chptr_t> parse_element(
+        parser::element<chptr_t> e, handler& h, fallback_t fallback)
+    {
+        match_context<chptr_t, handler, fallback_t> x(h, &fallback);
+        chptr_t p(e.ptr());
+        if (matcher<schema_t>::match(p, x))
+        {
+            x.commit();
+            return parser::content<chptr_t>(p);
+        }
+        return fallback(e);
+    }
+}}
\ No newline at end of file
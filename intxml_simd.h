@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define INTXML_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__) || defined(__AVX__)
+#define INTXML_SSSE3
+#include <tmmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// This file contains the helpers for scanning contiguous input 16 bytes at
+// a time with SSE2.  Without SSE2 they fall back to byte loops.  Code using
+// SSSE3 (which MSVC only enables along with AVX) checks INTXML_SSSE3.
+
+namespace intxml
+{
+    // Index of the lowest set bit; mask must not be 0.
+    inline unsigned first_bit(unsigned mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long bit;
+        _BitScanForward(&bit, mask);
+        return static_cast<unsigned>(bit);
+#else
+        return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+    }
+
+    // A set of characters to look for, given as template arguments.
+    template <char... chs> struct char_set;
+
+    template <>
+    struct char_set<>
+    {
+        static bool contains(char) { return false; }
+
+#ifdef INTXML_SSE2
+        static __m128i match(__m128i) { return _mm_setzero_si128(); }
+#endif
+    };
+
+    template <char ch, char... rest>
+    struct char_set<ch, rest...>
+    {
+        static bool contains(char c) { return c == ch || char_set<rest...>::contains(c); }
+
+#ifdef INTXML_SSE2
+        static __m128i match(__m128i x)
+        {
+            return _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(ch)), char_set<rest...>::match(x));
+        }
+#endif
+    };
+
+    // Returns the first position in [p, end) holding one of chs, or end.
+    template <char... chs>
+    const char* find_any(const char* p, const char* end)
+    {
+#ifdef INTXML_SSE2
+        while (end - p >= 16)
+        {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(char_set<chs...>::match(x)));
+            if (mask) return p + first_bit(mask);
+            p += 16;
+        }
+#endif
+        while (p != end && !char_set<chs...>::contains(*p)) ++p;
+        return p;
+    }
+
+    // Returns the first position from p holding one of chs or the NUL
+    // terminator.  The length needn't be known: blocks are loaded from
+    // 16-byte aligned addresses, so a load never crosses into a page that
+    // the string doesn't extend into, even when it reads past the NUL.
+    template <char... chs>
+    const char* find_any_terminated(const char* p)
+    {
+#ifdef INTXML_SSE2
+        std::size_t skew = reinterpret_cast<std::uintptr_t>(p) & 15;
+        const __m128i* block = reinterpret_cast<const __m128i*>(p - skew);
+        const __m128i zero = _mm_setzero_si128();
+
+        __m128i x = _mm_load_si128(block);
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_or_si128(char_set<chs...>::match(x), _mm_cmpeq_epi8(x, zero)))) >> skew;
+        if (mask) return p + first_bit(mask);
+
+        while (true)
+        {
+            x = _mm_load_si128(++block);
+            mask = static_cast<unsigned>(_mm_movemask_epi8(
+                _mm_or_si128(char_set<chs...>::match(x), _mm_cmpeq_epi8(x, zero))));
+            if (mask) return reinterpret_cast<const char*>(block) + first_bit(mask);
+        }
+#else
+        while (*p != 0 && !char_set<chs...>::contains(*p)) ++p;
+        return p;
+#endif
+    }
+
+    // Same as above, but also stops once at least limit bytes have been
+    // scanned, at the first unscanned position, which may hold any
+    // character.
+    template <char... chs>
+    const char* find_any_terminated(const char* p, std::size_t limit)
+    {
+#ifdef INTXML_SSE2
+        std::size_t skew = reinterpret_cast<std::uintptr_t>(p) & 15;
+        const __m128i* block = reinterpret_cast<const __m128i*>(p - skew);
+        const __m128i* stop = reinterpret_cast<const __m128i*>(p - skew + limit);
+        const __m128i zero = _mm_setzero_si128();
+
+        __m128i x = _mm_load_si128(block);
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_or_si128(char_set<chs...>::match(x), _mm_cmpeq_epi8(x, zero)))) >> skew;
+        if (mask) return p + first_bit(mask);
+
+        while (++block < stop)
+        {
+            x = _mm_load_si128(block);
+            mask = static_cast<unsigned>(_mm_movemask_epi8(
+                _mm_or_si128(char_set<chs...>::match(x), _mm_cmpeq_epi8(x, zero))));
+            if (mask) return reinterpret_cast<const char*>(block) + first_bit(mask);
+        }
+        return reinterpret_cast<const char*>(block);
+#else
+        const char* stop = p + limit;
+        while (p != stop && *p != 0 && !char_set<chs...>::contains(*p)) ++p;
+        return p;
+#endif
+    }
+}
\ No newline at end of file
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "intxml.h"
+#include "intxml_simd.h"
+#include <cstddef>
+
+// This file implements skipping of element subtrees for trusted input.  The
+// regular routines (parse_element_attribute_end etc.) check every name and
+// attribute they pass over.  These only look for the characters that change
+// what the next significant character is: "<" in content, the closing ">",
+// "/>" and quotes in tags, and the terminators of comments, CDATA sections
+// and processing instructions.  Nesting is tracked with a depth counter, and
+// end tags are assumed to match their start tags.  Input that isn't
+// well-formed gives an unspecified (but in-bounds) result; reaching the end
+// of the document still throws parsing_exception.
+//
+// On const char* and padded_ptr cursors each of those characters is found
+// 16 bytes at a time with SSE2 (see intxml_simd.h).  The parser:: and pull
+// interfaces expose this through overloads of sibling() taking trusted.
+
+namespace intxml
+{
+    // Tag selecting the trusted fast paths.
+    struct trusted_t {};
+    const trusted_t trusted = trusted_t();
+
+    // Advances c to the next of chs, or to the end of the document.
+    template <char... chs, typename chptr_t>
+    void skip_to(chptr_t& c)
+    {
+        while (!is_null(c) && !char_set<chs...>::contains(*c)) ++c;
+    }
+
+    template <char... chs>
+    void skip_to(const char*& c)
+    {
+        c = find_any_terminated<chs...>(c);
+    }
+
+    template <char... chs>
+    void skip_to(padded_ptr& c)
+    {
+        c = padded_ptr(find_any_terminated<chs...>(c.get()));
+    }
+
+    // Skips past count or more ch followed by ">", e.g., the "-->" ending a
+    // comment.
+    template <char ch, std::size_t count, typename chptr_t>
+    void skip_past_terminator(chptr_t& c)
+    {
+        while (true)
+        {
+            skip_to<ch>(c);
+            if (is_null(c)) throw parsing_exception(c);
+
+            std::size_t run = 0;
+            while (*c == ch)
+            {
+                ++run;
+                ++c;
+            }
+            if (run >= count && *c == '>')
+            {
+                ++c;
+                return;
+            }
+        }
+    }
+
+    // Skips the rest of a start tag, from anywhere before its first
+    // attribute, and returns true if it ends with ">" rather than "/>".
+    template <typename chptr_t>
+    bool skip_start_tag(chptr_t& c)
+    {
+        while (true)
+        {
+            skip_to<'>', '/', '"', '\''>(c);
+            switch (*c)
+            {
+            case '>':
+                ++c;
+                return true;
+            case '/':
+                ++c;
+                if (*c == '>')
+                {
+                    ++c;
+                    return false;
+                }
+                break;
+            case '"':
+                ++c;
+                skip_to<'"'>(c);
+                if (is_null(c)) throw parsing_exception(c);
+                ++c;
+                break;
+            case '\'':
+                ++c;
+                skip_to<'\''>(c);
+                if (is_null(c)) throw parsing_exception(c);
+                ++c;
+                break;
+            default:
+                throw parsing_exception(c);
+            }
+        }
+    }
+
+    // Trusted counterpart of parse_element_content: skips the remaining
+    // content of an element, following the ">" of its start tag, including
+    // its end tag.
+    template <typename chptr_t>
+    void skip_element_content(chptr_t& c)
+    {
+        std::size_t depth = 1;
+        while (true)
+        {
+            skip_to<'<'>(c);
+            if (is_null(c)) throw parsing_exception(c);
+            ++c;
+
+            switch (*c)
+            {
+            case '/':
+                skip_to<'>'>(c);
+                if (is_null(c)) throw parsing_exception(c);
+                ++c;
+                if (--depth == 0) return;
+                break;
+            case '!':
+                ++c;
+                if (*c == '-') skip_past_terminator<'-', 2>(c);
+                else skip_past_terminator<']', 2>(c);
+                break;
+            case '?':
+                skip_past_terminator<'?', 1>(c);
+                break;
+            default:
+                if (skip_start_tag(c)) ++depth;
+                break;
+            }
+        }
+    }
+
+    // Trusted counterparts of parse_element_attribute_end and
+    // parse_element_name_end.  Since attributes aren't parsed, both simply
+    // skip the rest of the start tag.
+    template <typename chptr_t>
+    void skip_element_attribute_end(chptr_t& c)
+    {
+        if (skip_start_tag(c)) skip_element_content(c);
+    }
+
+    template <typename chptr_t>
+    void skip_element_name_end(chptr_t& c)
+    {
+        skip_element_attribute_end(c);
+    }
+}
\ No newline at end of file
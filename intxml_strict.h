@@ -0,0 +1,392 @@
+#pragma once
+
+#include "intxml.h"
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// This file implements an opt-in well-formedness mode on top of the
+// routines in intxml.h.  In addition to what the regular routines check, it
+// requires every end tag to match its start tag, every attribute name to be
+// unique within its element, attributes to be separated by whitespace,
+// references to name a predefined entity or a legal character, and
+// attribute values not to contain "<".  Open tags are kept on an explicit
+// stack of name spans with precomputed length and hash, so an end tag is
+// checked with a single key compare before the characters are confirmed.
+// Since the stack holds copies of the cursor, chptr_t must be a forward
+// iterator.
+
+namespace intxml
+{
+    class well_formedness_exception : public parsing_exception
+    {
+    public:
+        template <typename chptr_t>
+        well_formedness_exception(chptr_t& c) : parsing_exception(c)
+        {
+        };
+    };
+
+    // A name in the document, identified by its first character along with
+    // its length and hash packed into a single key.
+    template <typename chptr_t>
+    struct name_span
+    {
+        chptr_t begin;
+        std::uint64_t key;
+
+        name_span() : begin(), key(0) {}
+
+        name_span(chptr_t ptr, std::size_t length, std::uint32_t hash) :
+            begin(ptr),
+            key((static_cast<std::uint64_t>(length) << 32) | hash)
+        {
+        }
+
+        std::size_t length() const { return static_cast<std::size_t>(key >> 32); }
+
+        std::uint32_t hash() const { return static_cast<std::uint32_t>(key); }
+
+        // Compares the key first, and only if that matches confirms the
+        // characters, so a mismatch never touches the document.
+        bool matches(const name_span& other) const
+        {
+            if (key != other.key) return false;
+
+            chptr_t a(begin);
+            chptr_t b(other.begin);
+            for (std::size_t n = length(); n > 0; --n, ++a, ++b)
+            {
+                if (*a != *b) return false;
+            }
+            return true;
+        }
+    };
+
+    // Parses a name and returns its span.
+    template <typename chptr_t>
+    name_span<chptr_t> parse_name_span(chptr_t& c)
+    {
+        chptr_t begin(c);
+        std::uint32_t hash;
+        std::size_t length = parse_name_hashed(c, hash);
+        return name_span<chptr_t>(begin, length, hash);
+    }
+
+    // Stack of open start tags.  Storage is allocated up front and reused
+    // across documents; it only grows if a document nests deeper than the
+    // initial capacity.
+    template <typename chptr_t>
+    class tag_stack
+    {
+        std::vector<name_span<chptr_t>> spans;
+        std::size_t count;
+
+    public:
+        explicit tag_stack(std::size_t capacity = 256) :
+            spans(capacity ? capacity : 1), count(0)
+        {
+        }
+
+        std::size_t depth() const { return count; }
+
+        bool empty() const { return count == 0; }
+
+        const name_span<chptr_t>& top() const { return spans[count - 1]; }
+
+        void push(const name_span<chptr_t>& span)
+        {
+            if (count == spans.size()) spans.resize(spans.size() * 2);
+            spans[count++] = span;
+        }
+
+        void pop() { --count; }
+
+        void clear() { count = 0; }
+    };
+
+    // Open-addressing set of the attribute names seen in the current start
+    // tag.  Slots are tagged with a generation number, so starting a new
+    // element is O(1) rather than a sweep of the table.
+    template <typename chptr_t>
+    class attribute_set
+    {
+        struct slot
+        {
+            name_span<chptr_t> name;
+            std::uint32_t generation;
+
+            slot() : generation(0) {}
+        };
+
+        std::vector<slot> slots;
+        std::size_t count;
+        std::uint32_t generation;
+
+        void grow()
+        {
+            std::vector<slot> old(slots.size() * 2);
+            old.swap(slots);
+            for (const slot& s : old)
+            {
+                if (s.generation == generation) place(s.name);
+            }
+        }
+
+        void place(const name_span<chptr_t>& name)
+        {
+            std::size_t mask = slots.size() - 1;
+            std::size_t i = name.hash() & mask;
+            while (slots[i].generation == generation) i = (i + 1) & mask;
+            slots[i].name = name;
+            slots[i].generation = generation;
+        }
+
+    public:
+        // The capacity is rounded up to a power of two.
+        explicit attribute_set(std::size_t capacity = 32) : count(0), generation(1)
+        {
+            std::size_t size = 1;
+            while (size < capacity) size *= 2;
+            slots.resize(size);
+        }
+
+        void clear()
+        {
+            count = 0;
+            if (++generation == 0)
+            {
+                for (slot& s : slots) s.generation = 0;
+                generation = 1;
+            }
+        }
+
+        // Returns false if an attribute with the same name is already
+        // present.
+        bool insert(const name_span<chptr_t>& name)
+        {
+            if ((count + 1) * 2 > slots.size()) grow();
+
+            std::size_t mask = slots.size() - 1;
+            std::size_t i = name.hash() & mask;
+            while (slots[i].generation == generation)
+            {
+                if (slots[i].name.matches(name)) return false;
+                i = (i + 1) & mask;
+            }
+
+            slots[i].name = name;
+            slots[i].generation = generation;
+            ++count;
+            return true;
+        }
+    };
+
+    // Parses documents and elements while checking that they are
+    // well-formed.  A checker can be reused for any number of documents,
+    // which avoids re-allocating its stacks.
+    template <typename chptr_t>
+    class well_formedness_checker
+    {
+        tag_stack<chptr_t> tags;
+        attribute_set<chptr_t> attributes;
+        std::size_t max_depth;
+
+        // Parses a reference following the "&", rejecting names other than
+        // the predefined entities and numbers that aren't legal characters.
+        void parse_reference(chptr_t& c)
+        {
+            if (*c != '#')
+            {
+                parse_entity_reference(c);
+                return;
+            }
+
+            ++c;
+            bool hex = *c == 'x';
+            if (hex) ++c;
+            if (*c == ';') throw well_formedness_exception(c);
+            int ch = hex ? parse_hex_character_reference(c) : parse_decimal_character_reference(c);
+            if (!(ch == 0x9 || ch == 0xa || ch == 0xd ||
+                  (ch >= 0x20 && ch <= 0xd7ff) ||
+                  (ch >= 0xe000 && ch <= 0xfffd) ||
+                  (ch >= 0x10000 && ch <= 0x10ffff)))
+            {
+                throw well_formedness_exception(c);
+            }
+        }
+
+        // Same as intxml::parse_attribute_value, additionally checking the
+        // references in the value and rejecting a raw "<".
+        void parse_attribute_value(chptr_t& c)
+        {
+            auto quote = *c;
+            if (quote != '\'' && quote != '"') throw parsing_exception(c);
+            ++c;
+
+            while (*c != quote)
+            {
+                if (is_null(c) || *c == '<') throw well_formedness_exception(c);
+                if (*c == '&')
+                {
+                    ++c;
+                    parse_reference(c);
+                }
+                else ++c;
+            }
+
+            ++c;
+        }
+
+        // Parses the attribute list of a start tag, rejecting duplicate
+        // names and attributes not separated by whitespace.
+        void parse_attributes(chptr_t& c)
+        {
+            attributes.clear();
+
+            while (true)
+            {
+                bool separated = std::isspace(static_cast<unsigned char>(*c)) != 0;
+                parse_whitespace(c);
+                if (*c == '/' || *c == '>') break;
+                if (!separated) throw well_formedness_exception(c);
+
+                name_span<chptr_t> name = parse_name_span(c);
+                if (!attributes.insert(name)) throw well_formedness_exception(name.begin);
+
+                parse_whitespace(c);
+                parse<'='>(c);
+                parse_whitespace(c);
+                parse_attribute_value(c);
+            }
+        }
+
+        // Same as intxml::parse_element_text, additionally checking the
+        // references in the text.
+        bool parse_element_text(chptr_t& c)
+        {
+            while (true)
+            {
+                while (*c != '<' && *c != '&')
+                {
+                    if (is_null(c) || *c == '>') throw parsing_exception(c);
+                    ++c;
+                }
+
+                if (*c == '&')
+                {
+                    ++c;
+                    parse_reference(c);
+                    continue;
+                }
+                ++c;
+
+                if (*c == '/')
+                {
+                    return false;
+                }
+                else if (*c == '!')
+                {
+                    ++c;
+                    if (*c == '-')
+                    {
+                        parse_literal<'-', '-'>(c);
+                        parse_comment_content_end(c);
+                    }
+                    else
+                    {
+                        parse_literal<'[', 'C', 'D', 'A', 'T', 'A', '['>(c);
+                        parse_cdata_content_end(c);
+                    }
+                }
+                else return true;
+            }
+        }
+
+        // Parses whatever may follow the root element: whitespace, comments
+        // and processing instructions.
+        void parse_misc(chptr_t& c)
+        {
+            parse_whitespace(c);
+
+            while (!is_null(c))
+            {
+                parse<'<'>(c);
+                if (*c == '?')
+                {
+                    ++c;
+                    parse_pi_content_end(c);
+                }
+                else
+                {
+                    parse_literal<'!', '-', '-'>(c);
+                    parse_comment_content_end(c);
+                }
+                parse_whitespace(c);
+            }
+        }
+
+    public:
+        explicit well_formedness_checker(
+            std::size_t depth_capacity = 256,
+            std::size_t attribute_capacity = 32,
+            std::size_t max_depth = default_max_depth) :
+            tags(depth_capacity), attributes(attribute_capacity), max_depth(max_depth)
+        {
+        }
+
+        // Same as intxml::parse_element_name_end.  Expects c to point to the
+        // name of a start tag and parses the entire element.  The tag stack 
+        // doubles as the depth stack, so this is iterative as well.
+        void parse_element_name_end(chptr_t& c)
+        {
+            std::size_t base = tags.depth();
+
+            while (true)
+            {
+                name_span<chptr_t> name = parse_name_span(c);
+                parse_attributes(c);
+                if (parse_start_tag_end(c))
+                {
+                    if (tags.depth() == max_depth) throw depth_limit_exception(c);
+                    tags.push(name);
+                }
+
+                // Consume end tags until either a child start tag is found
+                // or the element has been closed.
+                while (true)
+                {
+                    if (tags.depth() == base) return;
+                    if (parse_element_text(c)) break;
+
+                    ++c;
+                    name_span<chptr_t> end = parse_name_span(c);
+                    if (!tags.top().matches(end)) throw well_formedness_exception(end.begin);
+                    parse_whitespace(c);
+                    parse<'>'>(c);
+                    tags.pop();
+                }
+            }
+        }
+
+        // Same as intxml::parse_doc, additionally checking that nothing but
+        // comments, processing instructions and whitespace follow the root
+        // element.
+        void parse_doc(chptr_t& c)
+        {
+            tags.clear();
+            parse_prolog(c);
+            parse_element_name_end(c);
+            parse_misc(c);
+        }
+    };
+
+    // Convenience wrapper for checking a single document.
+    template <typename chptr_t>
+    void parse_doc_well_formed(chptr_t& c)
+    {
+        well_formedness_checker<chptr_t> checker;
+        checker.parse_doc(c);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "intxml.h"
+#include "intxml_simd.h"
+#include <cstddef>
+
+// This file implements reading the text content of an element as a
+// sequence of chunks rather than a character at a time (as text_ptr does),
+// for text nodes that are too large to handle one character per call, e.g.,
+// embedded binary payloads.
+//
+// The handler is called as h(begin, end) with const char* bounds, once per
+// chunk; a chunk is only valid during the call.  References are decoded
+// (to UTF-8), CDATA sections are included and comments left out; line ends
+// are passed through as written.  On const char* and padded_ptr cursors
+// runs of plain text are passed directly from the document, found 16 bytes
+// at a time with SSE2 and cut at text_chunk_size bytes so that a consumer
+// reads each run while it is still in cache.  Other cursors are copied
+// through a fixed buffer of that size, so memory use is constant either way.
+
+namespace intxml
+{
+    const std::size_t text_chunk_size = 1 << 14;
+
+    // Writes ch as UTF-8 to out, which must have room for 4 bytes, and
+    // returns the number of bytes written.
+    inline std::size_t encode_utf8(int ch, char* out)
+    {
+        if (ch < 0x80)
+        {
+            out[0] = static_cast<char>(ch);
+            return 1;
+        }
+        if (ch < 0x800)
+        {
+            out[0] = static_cast<char>(0xc0 | (ch >> 6));
+            out[1] = static_cast<char>(0x80 | (ch & 0x3f));
+            return 2;
+        }
+        if (ch < 0x10000)
+        {
+            out[0] = static_cast<char>(0xe0 | (ch >> 12));
+            out[1] = static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+            out[2] = static_cast<char>(0x80 | (ch & 0x3f));
+            return 3;
+        }
+        out[0] = static_cast<char>(0xf0 | (ch >> 18));
+        out[1] = static_cast<char>(0x80 | ((ch >> 12) & 0x3f));
+        out[2] = static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+        out[3] = static_cast<char>(0x80 | (ch & 0x3f));
+        return 4;
+    }
+
+    // Parses a reference following the "&" and returns its character.
+    template <typename chptr_t>
+    int parse_reference(chptr_t& c)
+    {
+        if (*c == '#')
+        {
+            ++c;
+            return parse_character_reference(c);
+        }
+        return parse_entity_reference(c);
+    }
+
+    // Parses element content until either a child element or end tag is
+    // encountered, passing its text to h in chunks, and leaves c following
+    // the "<".  Returns true if a child element follows, like
+    // parse_element_text.
+    template <typename chptr_t, typename handler>
+    bool parse_text_chunks(chptr_t& c, handler& h)
+    {
+        char buffer[text_chunk_size + 4];
+        std::size_t n = 0;
+
+        auto put = [&](char ch)
+        {
+            if (n == text_chunk_size)
+            {
+                h(static_cast<const char*>(buffer), static_cast<const char*>(buffer + n));
+                n = 0;
+            }
+            buffer[n++] = ch;
+        };
+
+        while (true)
+        {
+            switch (*c)
+            {
+            case '&':
+            {
+                ++c;
+                char utf8[4];
+                std::size_t length = encode_utf8(parse_reference(c), utf8);
+                for (std::size_t i = 0; i < length; ++i) put(utf8[i]);
+                break;
+            }
+            case '<':
+                ++c;
+                if (*c != '!')
+                {
+                    if (n != 0) h(static_cast<const char*>(buffer), static_cast<const char*>(buffer + n));
+                    return *c != '/';
+                }
+                ++c;
+                if (*c == '-')
+                {
+                    parse_literal<'-', '-'>(c);
+                    parse_comment_content_end(c);
+                }
+                else
+                {
+                    // Copy up to the "]]>", holding back "]" that may be
+                    // part of it.
+                    parse_literal<'[', 'C', 'D', 'A', 'T', 'A', '['>(c);
+                    std::size_t brackets = 0;
+                    while (true)
+                    {
+                        if (is_null(c)) throw parsing_exception(c);
+                        char ch = *c;
+                        ++c;
+                        if (ch == '>' && brackets >= 2)
+                        {
+                            brackets -= 2;
+                            break;
+                        }
+                        if (ch == ']')
+                        {
+                            ++brackets;
+                            continue;
+                        }
+                        for (; brackets != 0; --brackets) put(']');
+                        put(ch);
+                    }
+                    for (; brackets != 0; --brackets) put(']');
+                }
+                break;
+            case '>':
+                throw parsing_exception(c);
+            default:
+                if (is_null(c)) throw parsing_exception(c);
+                put(*c);
+                ++c;
+                break;
+            }
+        }
+    }
+
+    template <typename handler>
+    bool parse_text_chunks(const char*& c, handler& h)
+    {
+        while (true)
+        {
+            const char* run = c;
+            c = find_any_terminated<'<', '&', '>'>(c, text_chunk_size);
+            if (c != run) h(run, c);
+
+            switch (*c)
+            {
+            case '&':
+            {
+                ++c;
+                char utf8[4];
+                std::size_t length = encode_utf8(parse_reference(c), utf8);
+                h(static_cast<const char*>(utf8), static_cast<const char*>(utf8 + length));
+                break;
+            }
+            case '<':
+                ++c;
+                if (*c != '!') return *c != '/';
+                ++c;
+                if (*c == '-')
+                {
+                    parse_literal<'-', '-'>(c);
+                    parse_comment_content_end(c);
+                }
+                else
+                {
+                    parse_literal<'[', 'C', 'D', 'A', 'T', 'A', '['>(c);
+                    const char* cdata = c;
+                    parse_cdata_content_end(c);
+                    if (c - 3 != cdata) h(cdata, c - 3);
+                }
+                break;
+            case '>':
+            case 0:
+                throw parsing_exception(c);
+            default:
+                // The run reached text_chunk_size.
+                break;
+            }
+        }
+    }
+
+    template <typename handler>
+    bool parse_text_chunks(padded_ptr& c, handler& h)
+    {
+        const char* p = c.get();
+        bool element = parse_text_chunks(p, h);
+        c = padded_ptr(p);
+        return element;
+    }
+}
\ No newline at end of file
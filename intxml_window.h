@@ -0,0 +1,237 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+// This file implements a forward iterator over a stream, for use with the
+// parser:: states, which copy the cursor and re-parse from the copies.
+// istream_adapter is only an input iterator, so those would otherwise need
+// the whole document in memory.
+//
+// The stream is read in chunks.  Each chunk counts the cursors pointing into
+// it, and the window releases chunks from the front as soon as no cursor
+// points into them, so only the data from the oldest live cursor onwards is
+// retained.  Memory use is therefore bounded by how far back the caller
+// holds on to positions, which with parser:: is usually a few states.  A
+// limit can be set to catch a caller that holds on to more.
+//
+// The pull interface (intxml_pull.h) is not supported over window_ptr.  Every
+// pull element keeps the positions of its start tag, and keeps its parent
+// alive, so merely walking the children of the root retains the chunk
+// holding the root's start tag and everything read after it.
+
+namespace intxml
+{
+    // Thrown when advancing a cursor would retain more than the window's
+    // limit, or when the limit is too small to advance at all.
+    class window_exception : public std::exception
+    {
+    };
+
+    class window_ptr;
+
+    class stream_window
+    {
+        friend class window_ptr;
+
+        struct chunk
+        {
+            std::vector<char> data;
+            std::size_t size;
+            std::uint64_t offset;
+            std::size_t refs;
+            chunk* next;
+        };
+
+        std::streambuf* sbuf;
+        std::size_t chunk_size;
+        std::size_t max_chunks;
+        bool eof;
+
+        // Retained chunks, oldest first.  Chunks are only released from the
+        // front, since cursors in older chunks still have to pass through the
+        // later ones.
+        std::deque<chunk*> live;
+        std::vector<std::unique_ptr<chunk>> storage;
+        std::vector<chunk*> spare;
+
+        chunk* allocate()
+        {
+            if (!spare.empty())
+            {
+                chunk* c = spare.back();
+                spare.pop_back();
+                return c;
+            }
+
+            storage.emplace_back(new chunk);
+            chunk* c = storage.back().get();
+            c->data.resize(chunk_size + 1);
+            return c;
+        }
+
+        // Reads the chunk following the newest one.  Returns null at the end
+        // of the input.
+        chunk* load()
+        {
+            if (eof) return nullptr;
+            if (max_chunks && live.size() == max_chunks) throw window_exception();
+
+            chunk* c = allocate();
+            std::streamsize n = sbuf->sgetn(c->data.data(), static_cast<std::streamsize>(chunk_size));
+            if (n <= 0)
+            {
+                eof = true;
+                spare.push_back(c);
+                return nullptr;
+            }
+
+            chunk* last = live.back();
+            c->size = static_cast<std::size_t>(n);
+            c->data[c->size] = 0;
+            c->offset = last->offset + last->size;
+            c->refs = 0;
+            c->next = nullptr;
+            last->next = c;
+            live.push_back(c);
+            return c;
+        }
+
+        void release(chunk* c)
+        {
+            if (--c->refs != 0 || c != live.front()) return;
+
+            // The newest chunk is kept, since the next one is linked from it.
+            while (live.size() > 1 && live.front()->refs == 0)
+            {
+                spare.push_back(live.front());
+                live.pop_front();
+            }
+        }
+
+    public:
+        // Reads from the stream in chunks of chunk_size bytes.  If max_chunks
+        // is not 0, advancing a cursor throws window_exception rather than
+        // retain more than that many chunks.  A cursor moving into the next
+        // chunk holds the previous one until the next has been read, so the
+        // limit must be at least 2; 1 throws window_exception.
+        stream_window(std::istream& istr, std::size_t chunk_size = 1 << 16, std::size_t max_chunks = 0) :
+            sbuf(istr.rdbuf()), chunk_size(chunk_size), max_chunks(max_chunks), eof(false)
+        {
+            if (max_chunks == 1) throw window_exception();
+
+            // The first chunk may be empty, which makes an empty stream read
+            // as a single NUL like any other end of input.
+            chunk* c = allocate();
+            std::streamsize n = sbuf->sgetn(c->data.data(), static_cast<std::streamsize>(chunk_size));
+            c->size = n > 0 ? static_cast<std::size_t>(n) : 0;
+            c->data[c->size] = 0;
+            c->offset = 0;
+            c->refs = 0;
+            c->next = nullptr;
+            eof = n <= 0;
+            live.push_back(c);
+        }
+
+        stream_window(const stream_window&) = delete;
+        stream_window& operator=(const stream_window&) = delete;
+
+        // A cursor at the start of the stream.  Throws window_exception if
+        // that has already been released.
+        window_ptr begin();
+
+        // Bytes currently held in memory.
+        std::size_t retained() const { return live.size() * chunk_size; }
+    };
+
+    // Cursor into a stream_window.  Reads as 0 at the end of the input, and
+    // must not outlive the window.
+    class window_ptr : public std::iterator<std::forward_iterator_tag, char>
+    {
+        typedef stream_window::chunk chunk;
+
+        stream_window* window;
+        chunk* ch;
+        std::size_t pos;
+
+        // Moves to the start of the next chunk, if there is one.  Otherwise
+        // pos stays at the end of the last chunk, where the data reads as 0.
+        void advance()
+        {
+            chunk* next = ch->next ? ch->next : window->load();
+            if (!next)
+            {
+                pos = ch->size;
+                return;
+            }
+
+            ++next->refs;
+            chunk* old = ch;
+            ch = next;
+            pos = 0;
+            window->release(old);
+        }
+
+    public:
+        window_ptr() : window(nullptr), ch(nullptr), pos(0) {}
+
+        window_ptr(stream_window* w, stream_window::chunk* c, std::size_t p) : window(w), ch(c), pos(p)
+        {
+            ++ch->refs;
+        }
+
+        window_ptr(const window_ptr& other) : window(other.window), ch(other.ch), pos(other.pos)
+        {
+            if (ch) ++ch->refs;
+        }
+
+        window_ptr& operator=(const window_ptr& other)
+        {
+            if (other.ch) ++other.ch->refs;
+            if (ch) window->release(ch);
+            window = other.window;
+            ch = other.ch;
+            pos = other.pos;
+            return *this;
+        }
+
+        ~window_ptr()
+        {
+            if (ch) window->release(ch);
+        }
+
+        char operator*() const { return ch->data[pos]; }
+
+        window_ptr& operator++()
+        {
+            if (++pos >= ch->size) advance();
+            return *this;
+        }
+
+        window_ptr operator++(int)
+        {
+            window_ptr tmp(*this);
+            operator++();
+            return tmp;
+        }
+
+        // Offset from the start of the stream.
+        std::uint64_t offset() const { return ch->offset + pos; }
+
+        bool operator==(const window_ptr& other) const { return offset() == other.offset(); }
+
+        bool operator!=(const window_ptr& other) const { return offset() != other.offset(); }
+    };
+
+    inline window_ptr stream_window::begin()
+    {
+        if (live.front()->offset != 0) throw window_exception();
+        return window_ptr(this, live.front(), 0);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,812 @@
+// Converts the records of an XML document, i.e., the children of its root
+// element, to NDJSON or CSV.
+//
+//     intxml_transcode -m SPEC [options] [FILE]
+//
+//     -m, --map SPEC      output columns, as a comma-separated list of
+//                         column=path (may be repeated)
+//     -f, --format FMT    ndjson (the default) or csv
+//     -r, --record NAME   only convert children of the root with this name
+//     -t, --threads N     worker threads, or 0 for one per core (default 1)
+//     -s, --stream        read FILE as a stream instead of mapping it
+//         --no-header     leave out the CSV header line
+//
+// Paths are relative to the record: "@id" is an attribute of the record,
+// "." its text, "addr/city" the text of a descendant and "addr/@kind" an
+// attribute of one.  The first matching element is used, and columns with
+// no match are written as null (NDJSON) or empty (CSV).  The text of an
+// element is its own character data and CDATA sections, with references
+// decoded; comments and child elements are left out.
+//
+// A regular FILE is mapped into memory, and with more than one thread its
+// records are split off in batches and converted in parallel, with the
+// output kept in document order.  Standard input (or FILE with --stream) is
+// read through a buffer that only holds the unconsumed part of the input,
+// and is converted on one thread.
+//
+// There are no build files; from the repository root, e.g.
+//
+//     g++ -std=c++11 -O2 -I. tools/intxml_transcode.cpp -o intxml_transcode -pthread
+
+#include "intxml_records.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    using namespace intxml;
+
+    const char* const usage =
+        "usage: intxml_transcode -m column=path[,column=path...] [options] [FILE]\n"
+        "  -m, --map SPEC      output columns (may be repeated)\n"
+        "  -f, --format FMT    ndjson (default) or csv\n"
+        "  -r, --record NAME   only convert children of the root with this name\n"
+        "  -t, --threads N     worker threads, 0 for one per core (default 1)\n"
+        "  -s, --stream        read FILE as a stream instead of mapping it\n"
+        "      --no-header     leave out the CSV header line\n";
+
+    class usage_error : public std::runtime_error
+    {
+    public:
+        usage_error(const std::string& message) : std::runtime_error(message) {}
+    };
+
+    enum format_t { ndjson, csv };
+
+    // The mapping is a tree with a node for each element named on some path.
+    // Each node lists the columns taken from its attributes and its text.
+    struct field_node
+    {
+        std::string name;
+        std::vector<field_node> children;
+        std::vector<std::pair<std::string, std::size_t>> attributes;
+        std::vector<std::size_t> text;
+
+        explicit field_node(const std::string& n) : name(n) {}
+
+        const field_node* find(const char* n, std::size_t length) const
+        {
+            for (const field_node& child : children)
+            {
+                if (child.name.size() == length && std::memcmp(child.name.data(), n, length) == 0) return &child;
+            }
+            return nullptr;
+        }
+
+        field_node& descend(const std::string& n)
+        {
+            for (field_node& child : children)
+            {
+                if (child.name == n) return child;
+            }
+            children.push_back(field_node(n));
+            return children.back();
+        }
+    };
+
+    struct field_map
+    {
+        std::vector<std::string> columns;
+        field_node root;
+
+        field_map() : root("") {}
+
+        void add(const std::string& column, const std::string& path)
+        {
+            std::size_t index = columns.size();
+            columns.push_back(column);
+
+            field_node* n = &root;
+            std::size_t pos = 0;
+            while (true)
+            {
+                std::size_t slash = path.find('/', pos);
+                std::string step = path.substr(pos, slash == std::string::npos ? slash : slash - pos);
+                if (step.empty()) throw usage_error("empty step in path \"" + path + "\"");
+
+                bool last = slash == std::string::npos;
+                if (last && step[0] == '@')
+                {
+                    n->attributes.push_back(std::make_pair(step.substr(1), index));
+                    return;
+                }
+                if (step != ".") n = &n->descend(step);
+                if (last)
+                {
+                    n->text.push_back(index);
+                    return;
+                }
+                pos = slash + 1;
+            }
+        }
+
+        // Adds the columns of a "column=path,column=path" list.
+        void parse(const std::string& spec)
+        {
+            std::size_t pos = 0;
+            while (pos <= spec.size())
+            {
+                std::size_t comma = std::min(spec.find(',', pos), spec.size());
+                std::string field = spec.substr(pos, comma - pos);
+                std::size_t equals = field.find('=');
+                if (equals == std::string::npos || equals == 0)
+                {
+                    throw usage_error("expected column=path, got \"" + field + "\"");
+                }
+                add(field.substr(0, equals), field.substr(equals + 1));
+                pos = comma + 1;
+            }
+        }
+    };
+
+    // Column values of the record being converted.  The strings keep their
+    // capacity from record to record.
+    struct record_values
+    {
+        std::vector<std::string> values;
+        std::vector<char> present;
+
+        explicit record_values(std::size_t count) : values(count), present(count) {}
+
+        void reset()
+        {
+            for (std::string& v : values) v.clear();
+            std::fill(present.begin(), present.end(), 0);
+        }
+    };
+
+    void append_utf8(std::string& s, int ch)
+    {
+        if (ch < 0x80) s += static_cast<char>(ch);
+        else if (ch < 0x800)
+        {
+            s += static_cast<char>(0xc0 | (ch >> 6));
+            s += static_cast<char>(0x80 | (ch & 0x3f));
+        }
+        else if (ch < 0x10000)
+        {
+            s += static_cast<char>(0xe0 | (ch >> 12));
+            s += static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+            s += static_cast<char>(0x80 | (ch & 0x3f));
+        }
+        else
+        {
+            s += static_cast<char>(0xf0 | (ch >> 18));
+            s += static_cast<char>(0x80 | ((ch >> 12) & 0x3f));
+            s += static_cast<char>(0x80 | ((ch >> 6) & 0x3f));
+            s += static_cast<char>(0x80 | (ch & 0x3f));
+        }
+    }
+
+    // Appends the characters of [begin, end) with entity and character
+    // references replaced.
+    void append_decoded(std::string& s, const char* begin, const char* end)
+    {
+        while (begin != end)
+        {
+            const char* amp = static_cast<const char*>(std::memchr(begin, '&', end - begin));
+            if (!amp)
+            {
+                s.append(begin, end);
+                return;
+            }
+            s.append(begin, amp);
+
+            const char* c = amp + 1;
+            if (*c == '#')
+            {
+                ++c;
+                append_utf8(s, parse_character_reference(c));
+            }
+            else append_utf8(s, parse_entity_reference(c));
+            begin = c;
+        }
+    }
+
+    // Collects the values mapped by n from the element whose name c follows,
+    // and leaves c following the element.  Only mapped elements are looked
+    // into; everything else is skipped.
+    void collect(const char*& c, const field_node& n, record_values& v)
+    {
+        parse_whitespace(c);
+        while (*c != '/' && *c != '>')
+        {
+            const char* name = c;
+            parse_attribute_name(c);
+            std::size_t length = static_cast<std::size_t>(c - name);
+            parse_whitespace(c);
+            parse<'='>(c);
+            parse_whitespace(c);
+            const char* value = c + 1;
+            parse_attribute_value(c);
+
+            for (const std::pair<std::string, std::size_t>& a : n.attributes)
+            {
+                if (!v.present[a.second] &&
+                    a.first.size() == length &&
+                    std::memcmp(a.first.data(), name, length) == 0)
+                {
+                    append_decoded(v.values[a.second], value, c - 1);
+                    v.present[a.second] = 1;
+                }
+            }
+            parse_whitespace(c);
+        }
+
+        // The text columns of a node are always filled together, so checking
+        // the first tells whether this is the first matching element.
+        bool want_text = !n.text.empty() && !v.present[n.text[0]];
+
+        if (parse_start_tag_end(c))
+        {
+            while (true)
+            {
+                const char* text = c;
+                parse_element_value(c);
+                if (want_text)
+                {
+                    for (std::size_t i : n.text) append_decoded(v.values[i], text, c);
+                }
+
+                if (*c != '<') throw parsing_exception(c);
+                ++c;
+
+                if (*c == '/')
+                {
+                    ++c;
+                    parse_name(c);
+                    parse<'>'>(c);
+                    break;
+                }
+                else if (*c == '!')
+                {
+                    ++c;
+                    if (*c == '-')
+                    {
+                        parse_literal<'-', '-'>(c);
+                        parse_comment_content_end(c);
+                    }
+                    else
+                    {
+                        parse_literal<'[', 'C', 'D', 'A', 'T', 'A', '['>(c);
+                        const char* cdata = c;
+                        parse_cdata_content_end(c);
+                        if (want_text)
+                        {
+                            for (std::size_t i : n.text) v.values[i].append(cdata, c - 3);
+                        }
+                    }
+                }
+                else
+                {
+                    const char* name = c;
+                    parse_name(c);
+                    const field_node* child = n.find(name, static_cast<std::size_t>(c - name));
+                    if (child) collect(c, *child, v);
+                    else parse_element_attribute_end(c);
+                }
+            }
+        }
+
+        if (want_text)
+        {
+            for (std::size_t i : n.text) v.present[i] = 1;
+        }
+    }
+
+    inline bool needs_json_escape(char ch)
+    {
+        return static_cast<unsigned char>(ch) < 0x20 || ch == '"' || ch == '\\';
+    }
+
+    // Appends s as a JSON string.  Runs of characters that need no escaping
+    // are copied in one append.
+    void append_json_string(std::string& out, const std::string& s)
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        out += '"';
+        const char* p = s.data();
+        const char* end = p + s.size();
+        while (true)
+        {
+            const char* run = p;
+            while (p != end && !needs_json_escape(*p)) ++p;
+            out.append(run, p);
+            if (p == end) break;
+
+            char ch = *p++;
+            switch (ch)
+            {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                out += "\\u00";
+                out += hex[(ch >> 4) & 0xf];
+                out += hex[ch & 0xf];
+                break;
+            }
+        }
+        out += '"';
+    }
+
+    // Appends s as a CSV field (RFC 4180), quoted only if it has to be.
+    void append_csv_field(std::string& out, const std::string& s)
+    {
+        if (s.find_first_of(",\"\r\n") == std::string::npos)
+        {
+            out += s;
+            return;
+        }
+
+        out += '"';
+        std::size_t pos = 0;
+        while (true)
+        {
+            std::size_t quote = s.find('"', pos);
+            out.append(s, pos, quote == std::string::npos ? quote : quote - pos);
+            if (quote == std::string::npos) break;
+            out += "\"\"";
+            pos = quote + 1;
+        }
+        out += '"';
+    }
+
+    // Formats records.  Not thread safe; each thread uses its own.
+    class transcoder
+    {
+        const field_map& map;
+        format_t format;
+        record_values values;
+
+        // For NDJSON, the escaped key of each column with the punctuation
+        // preceding its value.
+        std::vector<std::string> keys;
+
+    public:
+        transcoder(const field_map& m, format_t f) :
+            map(m), format(f), values(m.columns.size())
+        {
+            for (std::size_t i = 0; i < map.columns.size(); ++i)
+            {
+                std::string key(i == 0 ? "{" : ",");
+                append_json_string(key, map.columns[i]);
+                key += ':';
+                keys.push_back(key);
+            }
+        }
+
+        void header(std::string& out) const
+        {
+            for (std::size_t i = 0; i < map.columns.size(); ++i)
+            {
+                if (i > 0) out += ',';
+                append_csv_field(out, map.columns[i]);
+            }
+            out += '\n';
+        }
+
+        // Appends a line for the record starting at begin (its "<").
+        void record(std::string& out, const char* begin)
+        {
+            values.reset();
+            const char* c = begin + 1;
+            parse_name(c);
+            collect(c, map.root, values);
+
+            for (std::size_t i = 0; i < values.values.size(); ++i)
+            {
+                if (format == ndjson)
+                {
+                    out += keys[i];
+                    if (values.present[i]) append_json_string(out, values.values[i]);
+                    else out += "null";
+                }
+                else
+                {
+                    if (i > 0) out += ',';
+                    append_csv_field(out, values.values[i]);
+                }
+            }
+            if (format == ndjson) out += '}';
+            out += '\n';
+        }
+    };
+
+    // Collects output in a large buffer and writes it out in big blocks.
+    class output
+    {
+        static const std::size_t flush_size = 1 << 20;
+
+        std::FILE* f;
+        std::string buffer;
+
+    public:
+        explicit output(std::FILE* file) : f(file)
+        {
+            buffer.reserve(flush_size * 2);
+        }
+
+        std::string& text() { return buffer; }
+
+        void flush_if_full()
+        {
+            if (buffer.size() >= flush_size) flush();
+        }
+
+        void flush()
+        {
+            if (!buffer.empty() && std::fwrite(buffer.data(), 1, buffer.size(), f) != buffer.size())
+            {
+                throw std::runtime_error(std::string("write failed: ") + std::strerror(errno));
+            }
+            buffer.clear();
+        }
+    };
+
+    // Puts the output of batches converted out of order back into document
+    // order.
+    class ordered_output
+    {
+        output& out;
+        std::mutex lock;
+        std::map<std::size_t, std::string> pending;
+        std::size_t next;
+
+    public:
+        explicit ordered_output(output& o) : out(o), next(0) {}
+
+        void write(std::size_t sequence, std::string& text)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending[sequence].swap(text);
+
+            auto i = pending.begin();
+            while (i != pending.end() && i->first == next)
+            {
+                out.text() += i->second;
+                out.flush_if_full();
+                i = pending.erase(i);
+                ++next;
+            }
+        }
+    };
+
+    bool record_name_matches(const char* p, const char* name)
+    {
+        if (!name) return true;
+
+        std::size_t length = std::strlen(name);
+        if (std::strncmp(p, name, length) != 0) return false;
+
+        char next = p[length];
+        return std::isspace(static_cast<unsigned char>(next)) || next == '/' || next == '>';
+    }
+
+    // Splits a document read from a stream into records.  Only the
+    // unconsumed part of the input is kept in memory.  The parsing routines
+    // throw on reaching the NUL after the data read so far, so a record that
+    // fails to parse is retried with more input, and the error is only
+    // passed on once the input is exhausted.
+    class stream_splitter
+    {
+        static const std::size_t chunk = 1 << 20;
+
+        std::FILE* in;
+        std::vector<char> buffer;
+        std::size_t size;
+        std::size_t pos;
+        bool eof;
+        bool done;
+        const char* name;
+
+        // Discards the consumed input and reads more, at least as much as is
+        // already buffered so that a large record isn't re-parsed too often.
+        // Returns false at the end of the input.
+        bool fill()
+        {
+            if (eof) return false;
+
+            size -= pos;
+            std::memmove(buffer.data(), buffer.data() + pos, size);
+            pos = 0;
+
+            std::size_t want = std::max(chunk, size);
+            if (buffer.size() < size + want + 1 + padding) buffer.resize(size + want + 1 + padding);
+
+            std::size_t n = std::fread(buffer.data() + size, 1, want, in);
+            if (n < want)
+            {
+                if (std::ferror(in)) throw std::runtime_error(std::string("read failed: ") + std::strerror(errno));
+                eof = true;
+            }
+            size += n;
+            std::fill(buffer.begin() + size, buffer.begin() + size + 1 + padding, 0);
+            return true;
+        }
+
+    public:
+        stream_splitter(std::FILE* input, const char* record_name = nullptr) :
+            in(input), buffer(1 + padding, 0), size(0), pos(0), eof(false), done(false), name(record_name)
+        {
+            while (true)
+            {
+                try
+                {
+                    parser::attribute<const char*> root = parser::document<const char*>(buffer.data()).root().name();
+                    const char* c = root.ptr();
+                    parse_attributes(c);
+                    done = !parse_start_tag_end(c);
+                    pos = static_cast<std::size_t>(c - buffer.data());
+                    break;
+                }
+                catch (const parsing_exception&)
+                {
+                    if (!fill()) throw;
+                }
+            }
+        }
+
+        // Returns false once the end tag of the root element is reached.
+        // The span is valid until the next call.
+        bool next(record_span& record)
+        {
+            while (!done)
+            {
+                const char* c = buffer.data() + pos;
+                try
+                {
+                    if (!parse_element_text(c))
+                    {
+                        done = true;
+                        break;
+                    }
+                    record.begin = c - 1;
+                    parse_element_name_end(c);
+                    record.end = c;
+                }
+                catch (const parsing_exception&)
+                {
+                    if (!fill()) throw;
+                    continue;
+                }
+
+                pos = static_cast<std::size_t>(record.end - buffer.data());
+                if (record_name_matches(record.begin + 1, name)) return true;
+            }
+            return false;
+        }
+    };
+
+    // A regular file mapped read-only and followed by zeroed memory, so that
+    // the document is NUL-terminated.
+    class mapped_file
+    {
+        void* base;
+        std::size_t length;
+
+    public:
+        explicit mapped_file(int fd, std::size_t size)
+        {
+            std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+            length = (size + 1 + padding + page - 1) / page * page;
+
+            base = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED) throw std::runtime_error(std::string("mmap failed: ") + std::strerror(errno));
+
+            // The tail of the file's last page reads as zero, as does the
+            // anonymous memory past it.
+            if (size > 0 && ::mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+            {
+                int error = errno;
+                ::munmap(base, length);
+                throw std::runtime_error(std::string("mmap failed: ") + std::strerror(error));
+            }
+            ::madvise(base, size, MADV_SEQUENTIAL);
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        ~mapped_file() { ::munmap(base, length); }
+
+        const char* data() const { return static_cast<const char*>(base); }
+    };
+
+    struct options
+    {
+        field_map map;
+        format_t format;
+        const char* record_name;
+        std::size_t threads;
+        bool stream;
+        bool header;
+        const char* path;
+
+        options() :
+            format(ndjson), record_name(nullptr), threads(1), stream(false), header(true), path(nullptr)
+        {
+        }
+    };
+
+    options parse_arguments(int argc, char** argv)
+    {
+        options o;
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg(argv[i]);
+            auto value = [&]() -> const char*
+            {
+                if (i + 1 == argc) throw usage_error("missing value for " + arg);
+                return argv[++i];
+            };
+
+            if (arg == "-m" || arg == "--map") o.map.parse(value());
+            else if (arg == "-f" || arg == "--format")
+            {
+                std::string f(value());
+                if (f == "ndjson") o.format = ndjson;
+                else if (f == "csv") o.format = csv;
+                else throw usage_error("unknown format \"" + f + "\"");
+            }
+            else if (arg == "-r" || arg == "--record") o.record_name = value();
+            else if (arg == "-t" || arg == "--threads")
+            {
+                char* end;
+                const char* n = value();
+                o.threads = static_cast<std::size_t>(std::strtoul(n, &end, 10));
+                if (*n == 0 || *end != 0) throw usage_error("bad thread count \"" + std::string(n) + "\"");
+            }
+            else if (arg == "-s" || arg == "--stream") o.stream = true;
+            else if (arg == "--no-header") o.header = false;
+            else if (arg == "-" || arg[0] != '-')
+            {
+                if (o.path) throw usage_error("more than one input file");
+                o.path = argv[i];
+            }
+            else throw usage_error("unknown option " + arg);
+        }
+
+        if (o.map.columns.empty()) throw usage_error("no columns given");
+        return o;
+    }
+
+    void convert_stream(std::FILE* in, const options& o, output& out)
+    {
+        transcoder t(o.map, o.format);
+        stream_splitter splitter(in, o.record_name);
+        record_span r;
+        while (splitter.next(r))
+        {
+            t.record(out.text(), r.begin);
+            out.flush_if_full();
+        }
+    }
+
+    void convert_mapped(const char* doc, const options& o, output& out)
+    {
+        if (o.threads == 1)
+        {
+            transcoder t(o.map, o.format);
+            record_splitter splitter(doc, o.record_name);
+            record_span r;
+            while (splitter.next(r))
+            {
+                t.record(out.text(), r.begin);
+                out.flush_if_full();
+            }
+            return;
+        }
+
+        ordered_output ordered(out);
+        record_options ro;
+        ro.threads = o.threads;
+        ro.record_name = o.record_name;
+
+        process_record_batches(doc, [&](const record_batch& b)
+        {
+            transcoder t(o.map, o.format);
+            std::string text;
+            for (const record_span& r : b.records) t.record(text, r.begin);
+            ordered.write(b.sequence, text);
+        }, ro);
+    }
+
+    void run(const options& o)
+    {
+        output out(stdout);
+        if (o.format == csv && o.header)
+        {
+            transcoder(o.map, o.format).header(out.text());
+        }
+
+        if (!o.path || std::strcmp(o.path, "-") == 0) convert_stream(stdin, o, out);
+        else
+        {
+            int fd = ::open(o.path, O_RDONLY);
+            if (fd < 0) throw std::runtime_error(std::string(o.path) + ": " + std::strerror(errno));
+
+            struct stat info;
+            if (!o.stream && ::fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+            {
+                try
+                {
+                    mapped_file file(fd, static_cast<std::size_t>(info.st_size));
+                    ::close(fd);
+                    fd = -1;
+                    convert_mapped(file.data(), o, out);
+                }
+                catch (...)
+                {
+                    if (fd >= 0) ::close(fd);
+                    throw;
+                }
+            }
+            else
+            {
+                std::FILE* in = ::fdopen(fd, "rb");
+                if (!in)
+                {
+                    ::close(fd);
+                    throw std::runtime_error(std::string(o.path) + ": " + std::strerror(errno));
+                }
+                try
+                {
+                    convert_stream(in, o, out);
+                }
+                catch (...)
+                {
+                    std::fclose(in);
+                    throw;
+                }
+                std::fclose(in);
+            }
+        }
+
+        out.flush();
+        if (std::fflush(stdout) != 0) throw std::runtime_error(std::string("write failed: ") + std::strerror(errno));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    try
+    {
+        run(parse_arguments(argc, argv));
+        return 0;
+    }
+    catch (const usage_error& e)
+    {
+        std::fprintf(stderr, "intxml_transcode: %s\n%s", e.what(), usage);
+        return 2;
+    }
+    catch (const intxml::parsing_exception&)
+    {
+        std::fprintf(stderr, "intxml_transcode: malformed document\n");
+    }
+    catch (const intxml::parser::parser_exception&)
+    {
+        std::fprintf(stderr, "intxml_transcode: malformed document\n");
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "intxml_transcode: %s\n", e.what());
+    }
+    return 1;
+}
\ No newline at end of file